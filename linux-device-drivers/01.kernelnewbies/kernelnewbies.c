@@ -4,6 +4,8 @@
 #include <linux/kfifo.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/atomic.h>
+#include <linux/wait_bit.h>
 
 MODULE_AUTHOR("Arabic Linux Community");
 MODULE_DESCRIPTION("kernelnewbies ldd");
@@ -18,6 +20,14 @@ MODULE_LICENSE("GPL");
 static int fsize = DEFAULT_FIFO_SIZE;
 module_param(fsize, int, S_IRUGO);
 
+/**
+ * spsc - skip the fifo mutexes while there is a single reader and
+ * a single writer, kfifo is safe without locking in that case.
+ */
+static bool spsc = true;
+module_param(spsc, bool, S_IRUGO);
+MODULE_PARM_DESC(spsc, "lockless fifo access for single reader/writer (default: Y)");
+
 static dev_t dev_nr;
 static struct class *new_class;
 static struct cdev new_cdevice;
@@ -26,14 +36,71 @@ static DEFINE_MUTEX(read_access);
 static DEFINE_MUTEX(write_access);
 static struct kfifo myfifo;
 
+/**
+ * Open files per direction and lockless calls currently running.
+ */
+static atomic_t nr_readers = ATOMIC_INIT(0);
+static atomic_t nr_writers = ATOMIC_INIT(0);
+static atomic_t rd_inflight = ATOMIC_INIT(0);
+static atomic_t wr_inflight = ATOMIC_INIT(0);
+
+static void fifo_lockless_exit(atomic_t *inflight)
+{
+	if (atomic_dec_and_test(inflight))
+		wake_up_var(inflight);
+}
+
+/**
+ * The open count proves SPSC usage only when this file is the one
+ * open file for that direction and no other thread shares it
+ * (a shared file is pinned by fdget(), so its count is above 1).
+ */
+static bool fifo_lockless_enter(struct file *filp, atomic_t *users,
+						atomic_t *inflight)
+{
+	if (!spsc)
+		return false;
+
+	atomic_inc(inflight);
+	smp_mb__after_atomic();
+	if (atomic_read(users) == 1 && file_count(filp) == 1)
+		return true;
+
+	fifo_lockless_exit(inflight);
+	return false;
+}
+
+/**
+ * Locked path, also waits for a lockless call that started before
+ * a second reader/writer showed up.
+ */
+static int fifo_lock(struct mutex *lock, atomic_t *inflight)
+{
+	if (mutex_lock_interruptible(lock))
+		return -ERESTARTSYS;
+
+	/** pairs with smp_mb__after_atomic() in fifo_lockless_enter() */
+	smp_mb();
+	wait_var_event(inflight, !atomic_read(inflight));
+	return 0;
+}
+
 static int driver_open_fifo(struct inode *inode, struct file *filp)
 {
+	if (filp->f_mode & FMODE_READ)
+		atomic_inc(&nr_readers);
+	if (filp->f_mode & FMODE_WRITE)
+		atomic_inc(&nr_writers);
 	pr_info("Open FIFO driver\n");
 	return 0;
 }
 
 static int driver_release_fifo(struct inode *inode, struct file *filp)
 {
+	if (filp->f_mode & FMODE_READ)
+		atomic_dec(&nr_readers);
+	if (filp->f_mode & FMODE_WRITE)
+		atomic_dec(&nr_writers);
 	pr_info("Close FIFO driver\n");
 	return 0;
 }
@@ -43,12 +110,11 @@ static ssize_t driver_write_fifo(struct file *file, const char __user *buf,
 {
 	int ret;
 	unsigned int copiedin;
-	int avail;
-	if (mutex_lock_interruptible(&write_access))
-		return -ERESTARTSYS;
+	bool lockless;
 
-	avail = kfifo_avail(&myfifo);
-	pr_info("kfifo available bytes %d\n", avail);
+	lockless = fifo_lockless_enter(file, &nr_writers, &wr_inflight);
+	if (!lockless && fifo_lock(&write_access, &wr_inflight))
+		return -ERESTARTSYS;
 
 	/**
 	 * kfifo_from_user - puts some data from user space into the fifo
@@ -58,9 +124,11 @@ static ssize_t driver_write_fifo(struct file *file, const char __user *buf,
 	 * @copied: pointer to output variable to store the number of copied bytes
 	 */
 	ret = kfifo_from_user(&myfifo, buf, count, &copiedin);
-	mutex_unlock(&write_access);
-	pr_info("The data copied: %d\n", copiedin);
-	
+	if (lockless)
+		fifo_lockless_exit(&wr_inflight);
+	else
+		mutex_unlock(&write_access);
+
 	/**
 	 * in case of -EFAULT -> ret to system 
 	 */
@@ -79,8 +147,10 @@ static ssize_t driver_read_fifo(struct file *file, char __user *buf,
 {
 	int ret;
 	unsigned int copiedout;
+	bool lockless;
 
-	if (mutex_lock_interruptible(&read_access))
+	lockless = fifo_lockless_enter(file, &nr_readers, &rd_inflight);
+	if (!lockless && fifo_lock(&read_access, &rd_inflight))
 		return -ERESTARTSYS;
 
 	/**
@@ -91,7 +161,10 @@ static ssize_t driver_read_fifo(struct file *file, char __user *buf,
 	 * @copied: pointer to output variable to store the number of copied bytes
 	 */
 	ret = kfifo_to_user(&myfifo, buf, count, &copiedout);
-	mutex_unlock(&read_access);
+	if (lockless)
+		fifo_lockless_exit(&rd_inflight);
+	else
+		mutex_unlock(&read_access);
 
 	/**
 	 * in case of -EFAULT -> ret to system 
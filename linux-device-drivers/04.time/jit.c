@@ -35,7 +35,25 @@
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/delay.h>
+#include <linux/cpu.h>
+#include <linux/smp.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/irq_work.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <asm/hardirq.h>
+#include "jitclock.h"
+#include "lathist.h"
 
 /**
  * This module is a silly one: it only embeds short code fragments
@@ -47,6 +65,50 @@ module_param(delay, int, 0);
 static int tdelay = 10;
 module_param(tdelay, int, 0);
 
+/**
+ * hrtimer period in ns and number of expiries for /proc/jithrtimer,
+ * the period is also the top half rate of /proc/jitdeferbench
+ */
+static ulong hrperiod = 100000;
+module_param(hrperiod, ulong, 0);
+static int hrloops = 1000;
+module_param(hrloops, int, 0);
+
+/**
+ * delay in us and repeats per method for /proc/jitdelaybench
+ */
+static ulong benchus = 1000;
+module_param(benchus, ulong, 0);
+static int benchloops = 20;
+module_param(benchloops, int, 0);
+
+/**
+ * expiries per cpu for /proc/jitcpumatrix and /proc/jitcpuhrmatrix
+ */
+static int cpuloops = 100;
+module_param(cpuloops, int, 0);
+
+/**
+ * sampling period in ns of the background monitor, and whether to
+ * start it at load time (echo 1/0 > /proc/jitmonitor otherwise)
+ */
+static ulong monperiod = 1000000;
+module_param(monperiod, ulong, 0);
+static bool monitor;
+module_param(monitor, bool, 0);
+
+/**
+ * update period in ns of the /dev/jitclock page
+ */
+static ulong clkperiod = 100000;
+module_param(clkperiod, ulong, 0);
+
+/**
+ * iterations per deferral method for /proc/jitdeferbench
+ */
+static int deferloops = 10000;
+module_param(deferloops, int, 0);
+
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -54,20 +116,34 @@ enum jit_files {
 	JIT_BUSY = 0,
 	JIT_SCHED,
 	JIT_QUEUE,
-	JIT_SCHEDTO
+	JIT_SCHEDTO,
+	/** delay methods below are only used by jitdelaybench */
+	JIT_UDELAY,
+	JIT_USLEEP,
+	JIT_MSLEEP,
+	JIT_FSLEEP,
+	JIT_NR_DELAYS
 };
 
-int jit_fn_show(struct seq_file *m, void *v)
+static const char * const jit_delay_names[JIT_NR_DELAYS] = {
+	[JIT_BUSY]	= "busy",
+	[JIT_SCHED]	= "sched",
+	[JIT_QUEUE]	= "queue",
+	[JIT_SCHEDTO]	= "schedto",
+	[JIT_UDELAY]	= "udelay",
+	[JIT_USLEEP]	= "usleep_range",
+	[JIT_MSLEEP]	= "msleep",
+	[JIT_FSLEEP]	= "fsleep",
+};
+
+static void jit_delay_jiffies(long method, unsigned long j)
 {
-	unsigned long j0, j1;
 	wait_queue_head_t wait;
-	long data = (long)m->private;
+	unsigned long j1 = jiffies + j;
 
 	init_waitqueue_head(&wait);
-	j0 = jiffies;
-	j1 = j0 + delay;
 
-	switch (data) {
+	switch (method) {
 	case JIT_BUSY:
 		while (time_before(jiffies, j1))
 			cpu_relax();
@@ -77,13 +153,22 @@ int jit_fn_show(struct seq_file *m, void *v)
 			schedule();
 		break;
 	case JIT_QUEUE:
-		wait_event_interruptible_timeout(wait, 0, delay);
+		wait_event_interruptible_timeout(wait, 0, j);
 		break;
 	case JIT_SCHEDTO:
 		set_current_state(TASK_INTERRUPTIBLE);
-		schedule_timeout(delay);
+		schedule_timeout(j);
 		break;
 	}
+}
+
+int jit_fn_show(struct seq_file *m, void *v)
+{
+	unsigned long j0, j1;
+	long data = (long)m->private;
+
+	j0 = jiffies;
+	jit_delay_jiffies(data, delay);
 	j1 = jiffies;
 
 	seq_printf(m, "%9li %9li\n", j0, j1);
@@ -173,6 +258,7 @@ int jit_timer_show(struct seq_file *m, void *v)
 {
 	struct jit_data *data;
 	unsigned long j = jiffies;
+	int ret = 0;
 
 	data = kmalloc(sizeof(*data), GFP_KERNEL);
 	if (!data)
@@ -193,11 +279,12 @@ int jit_timer_show(struct seq_file *m, void *v)
 	data->timer.expires = j + tdelay;
 	add_timer(&data->timer);
 
-	wait_event_interruptible(data->wait, !data->loops);
-	if (signal_pending(current))
-		return -ERESTARTSYS;
+	if (wait_event_interruptible(data->wait, !data->loops))
+		ret = -ERESTARTSYS;
+	/** the timer may still be armed or running after a signal */
+	del_timer_sync(&data->timer);
 	kfree(data);
-	return 0;
+	return ret;
 }
 
 static int jit_timer_open(struct inode *inode, struct file *file)
@@ -236,6 +323,7 @@ int jit_tasklet_show(struct seq_file *m, void *v)
 	struct jit_data *data;
 	unsigned long j = jiffies;
 	long hi = (long)m->private;
+	int ret = 0;
 
 	data = kmalloc(sizeof(*data), GFP_KERNEL);
 	if (!data)
@@ -259,12 +347,12 @@ int jit_tasklet_show(struct seq_file *m, void *v)
 	else
 		tasklet_schedule(&data->tlet);
 
-	wait_event_interruptible(data->wait, !data->loops);
-
-	if (signal_pending(current))
-		return -ERESTARTSYS;
+	if (wait_event_interruptible(data->wait, !data->loops))
+		ret = -ERESTARTSYS;
+	/** the tasklet may still be scheduled or running after a signal */
+	tasklet_kill(&data->tlet);
 	kfree(data);
-	return 0;
+	return ret;
 }
 
 static int jit_tasklet_open(struct inode *inode, struct file *file)
@@ -279,18 +367,1202 @@ static struct proc_ops jit_tasklet_fops = {
 	.proc_release	= single_release,
 };
 
+#define JIT_HRPERIOD_MIN	1000
+
+static void jit_hist_show(struct seq_file *m, struct lat_hist *h)
+{
+	if (!h->count) {
+		seq_puts(m, "no samples\n");
+		return;
+	}
+	seq_printf(m, "samples %llu min %llu avg %llu max %llu p99 <%llu (ns)\n",
+			h->count, h->min, lat_hist_avg(h),
+			h->max, lat_hist_pct(h, 99));
+	lat_hist_show(m, h);
+}
+
+/**
+ * The hrtimer version of jitimer: expire every hrperiod ns and
+ * record how late each expiry ran.
+ */
+struct jit_hrdata {
+	struct hrtimer timer;
+	ktime_t period;
+	struct lat_hist hist;
+	wait_queue_head_t wait;
+	int loops;
+};
+
+static enum hrtimer_restart jit_hrtimer_fn(struct hrtimer *t)
+{
+	struct jit_hrdata *data = container_of(t, struct jit_hrdata, timer);
+	ktime_t now = ktime_get();
+	s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(t)));
+
+	lat_hist_add(&data->hist, late > 0 ? late : 0);
+
+	if (--data->loops) {
+		hrtimer_forward(t, now, data->period);
+		return HRTIMER_RESTART;
+	}
+	wake_up_interruptible(&data->wait);
+	return HRTIMER_NORESTART;
+}
+
+int jit_hrtimer_show(struct seq_file *m, void *v)
+{
+	struct jit_hrdata *data;
+	int ret = 0;
+
+	if (hrloops <= 0)
+		return -EINVAL;
+
+	data = kmalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	init_waitqueue_head(&data->wait);
+	lat_hist_init(&data->hist);
+	data->period = ns_to_ktime(max_t(ulong, hrperiod, JIT_HRPERIOD_MIN));
+	data->loops = hrloops;
+
+	hrtimer_init(&data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	data->timer.function = jit_hrtimer_fn;
+	hrtimer_start(&data->timer, data->period, HRTIMER_MODE_REL);
+
+	if (wait_event_interruptible(data->wait, !READ_ONCE(data->loops)))
+		ret = -ERESTARTSYS;
+	/** also waits for a callback still running on another cpu */
+	hrtimer_cancel(&data->timer);
+
+	if (!ret) {
+		seq_printf(m, "period %lld ns, HZ %d\n",
+				ktime_to_ns(data->period), HZ);
+		jit_hist_show(m, &data->hist);
+	}
+	kfree(data);
+	return ret;
+}
+
+static int jit_hrtimer_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jit_hrtimer_show, NULL);
+}
+
+static struct proc_ops jit_hrtimer_fops = {
+	.proc_open		= jit_hrtimer_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * Run every delay method benchloops times for benchus and compare the
+ * elapsed time and the cpu time it burnt. The jiffies based methods
+ * round benchus up to whole jiffies. cpu time comes from the scheduler
+ * runtime, which is only brought up to date at ticks and context
+ * switches, so for the busy methods it may lag by up to a tick.
+ */
+static void jit_delay_us(long method, unsigned long us)
+{
+	switch (method) {
+	case JIT_UDELAY:
+		mdelay(us / 1000);
+		udelay(us % 1000);
+		break;
+	case JIT_USLEEP:
+		usleep_range(us, us + us / 4);
+		break;
+	case JIT_MSLEEP:
+		msleep(DIV_ROUND_UP(us, 1000));
+		break;
+	case JIT_FSLEEP:
+		fsleep(us);
+		break;
+	default:
+		jit_delay_jiffies(method, usecs_to_jiffies(us));
+		break;
+	}
+}
+
+int jit_delaybench_show(struct seq_file *m, void *v)
+{
+	struct lat_hist *h;
+	unsigned long us = max(benchus, 1UL);
+	long method;
+	int i;
+
+	if (benchloops <= 0)
+		return -EINVAL;
+
+	h = kmalloc(sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return -ENOMEM;
+
+	seq_printf(m, "delay %lu us, %d runs each, HZ %d\n",
+			us, benchloops, HZ);
+	seq_puts(m, "      method    avg(ns)    min(ns)    max(ns)  p99 <(ns)"
+			"    cpu(ns)  cpu%\n");
+
+	for (method = 0; method < JIT_NR_DELAYS; method++) {
+		u64 cpu = 0;
+
+		lat_hist_init(h);
+		for (i = 0; i < benchloops; i++) {
+			u64 c0 = current->se.sum_exec_runtime;
+			u64 t0 = ktime_get_ns();
+
+			jit_delay_us(method, us);
+			lat_hist_add(h, ktime_get_ns() - t0);
+			cpu += current->se.sum_exec_runtime - c0;
+
+			if (signal_pending(current)) {
+				kfree(h);
+				return -ERESTARTSYS;
+			}
+		}
+		seq_printf(m, "%12s %10llu %10llu %10llu %10llu %10llu %5llu\n",
+				jit_delay_names[method],
+				div64_u64(h->sum, h->count), h->min, h->max,
+				lat_hist_pct(h, 99), div64_u64(cpu, h->count),
+				div64_u64(cpu * 100, h->sum ? h->sum : 1));
+	}
+
+	kfree(h);
+	return 0;
+}
+
+static int jit_delaybench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jit_delaybench_show, NULL);
+}
+
+static struct proc_ops jit_delaybench_fops = {
+	.proc_open		= jit_delaybench_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * Arm one timer on every online cpu and keep it there for cpuloops
+ * expiries, then print a cpu x lateness bucket matrix. The timer_list
+ * version runs every tdelay jiffies and measures lateness against the
+ * arm time plus tdelay, so an expiry up to one tick early reads as 0.
+ * The hrtimer version runs every hrperiod ns. Hotplug is only held off
+ * while arming; a cpu that goes offline during the run has its timer
+ * migrated, which the callback notices and reports the cpu as gone.
+ */
+struct jit_cpumatrix;
+
+struct jit_cpuslot {
+	struct timer_list timer;
+	struct hrtimer hrtimer;
+	struct jit_cpumatrix *mx;
+	struct lat_hist hist;
+	u64 expected;
+	int cpu;
+	int loops;
+	bool gone;
+};
+
+struct jit_cpumatrix {
+	wait_queue_head_t wait;
+	atomic_t running;
+	bool stop;
+	unsigned long tj;
+	ktime_t period;
+	struct cpumask cpus;
+	struct jit_cpuslot slot[];
+};
+
+static void jit_cpu_done(struct jit_cpuslot *s)
+{
+	if (atomic_dec_and_test(&s->mx->running))
+		wake_up_interruptible(&s->mx->wait);
+}
+
+static void jit_cpu_timer_fn(struct timer_list *t)
+{
+	struct jit_cpuslot *s = from_timer(s, t, timer);
+	u64 now = ktime_get_ns();
+
+	if (smp_processor_id() != s->cpu) {
+		s->gone = true;
+		jit_cpu_done(s);
+		return;
+	}
+	lat_hist_add(&s->hist, now > s->expected ? now - s->expected : 0);
+
+	if (--s->loops && !READ_ONCE(s->mx->stop)) {
+		s->expected = now + jiffies_to_nsecs(s->mx->tj);
+		s->timer.expires = jiffies + s->mx->tj;
+		add_timer_on(&s->timer, s->cpu);
+		return;
+	}
+	jit_cpu_done(s);
+}
+
+static enum hrtimer_restart jit_cpu_hrtimer_fn(struct hrtimer *t)
+{
+	struct jit_cpuslot *s = container_of(t, struct jit_cpuslot, hrtimer);
+	ktime_t now = ktime_get();
+	s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(t)));
+
+	if (smp_processor_id() != s->cpu) {
+		s->gone = true;
+		jit_cpu_done(s);
+		return HRTIMER_NORESTART;
+	}
+	lat_hist_add(&s->hist, late > 0 ? late : 0);
+
+	if (--s->loops && !READ_ONCE(s->mx->stop)) {
+		hrtimer_forward(t, now, s->mx->period);
+		return HRTIMER_RESTART;
+	}
+	jit_cpu_done(s);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * Pinned hrtimers stay on the cpu they are started from
+ */
+static void jit_cpu_hrtimer_start(void *info)
+{
+	struct jit_cpuslot *s = info;
+
+	hrtimer_start(&s->hrtimer, s->mx->period, HRTIMER_MODE_REL_PINNED);
+}
+
+static void jit_cpumatrix_render(struct seq_file *m,
+				struct jit_cpumatrix *mx, long hr)
+{
+	int lo = LAT_HIST_BUCKETS, hi = -1;
+	int cpu, b;
+
+	for_each_cpu(cpu, &mx->cpus) {
+		for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+			if (!mx->slot[cpu].hist.bucket[b])
+				continue;
+			lo = min(lo, b);
+			hi = max(hi, b);
+		}
+	}
+
+	if (hr)
+		seq_printf(m, "hrtimer every %lld ns", ktime_to_ns(mx->period));
+	else
+		seq_printf(m, "timer every %lu jiffies", mx->tj);
+	seq_printf(m, ", %d expiries per cpu, column 2^b counts lateness < 2^b ns\n",
+			cpuloops);
+
+	seq_puts(m, "cpu  min(ns)  avg(ns)  max(ns)    p99 <");
+	for (b = lo; b <= hi; b++) {
+		if (b == LAT_HIST_LAST)
+			seq_printf(m, "  >=2^%-2d", b - 1);
+		else if (b)
+			seq_printf(m, "    2^%-2d", b);
+		else
+			seq_puts(m, "       0");
+	}
+	seq_putc(m, '\n');
+
+	for_each_cpu(cpu, &mx->cpus) {
+		struct lat_hist *h = &mx->slot[cpu].hist;
+
+		if (mx->slot[cpu].gone) {
+			seq_printf(m, "%3d offline\n", cpu);
+			continue;
+		}
+		if (!h->count)
+			continue;
+		seq_printf(m, "%3d %8llu %8llu %8llu %8llu", cpu, h->min,
+				div64_u64(h->sum, h->count), h->max,
+				lat_hist_pct(h, 99));
+		for (b = lo; b <= hi; b++)
+			seq_printf(m, " %7lu", h->bucket[b]);
+		seq_putc(m, '\n');
+	}
+}
+
+int jit_cpumatrix_show(struct seq_file *m, void *v)
+{
+	struct jit_cpumatrix *mx;
+	struct jit_cpuslot *s;
+	long hr = (long)m->private;
+	int cpu, ret = 0;
+
+	if (cpuloops <= 0)
+		return -EINVAL;
+
+	mx = kzalloc(struct_size(mx, slot, nr_cpu_ids), GFP_KERNEL);
+	if (!mx)
+		return -ENOMEM;
+
+	init_waitqueue_head(&mx->wait);
+	mx->tj = max(tdelay, 1);
+	mx->period = ns_to_ktime(max_t(ulong, hrperiod, JIT_HRPERIOD_MIN));
+
+	/** the cpus online now, any of them may go away during the run */
+	cpus_read_lock();
+	cpumask_copy(&mx->cpus, cpu_online_mask);
+	cpus_read_unlock();
+
+	for_each_cpu(cpu, &mx->cpus) {
+		s = &mx->slot[cpu];
+		s->mx = mx;
+		s->cpu = cpu;
+		s->loops = cpuloops;
+		lat_hist_init(&s->hist);
+		timer_setup(&s->timer, jit_cpu_timer_fn, TIMER_PINNED);
+		hrtimer_init(&s->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		s->hrtimer.function = jit_cpu_hrtimer_fn;
+		atomic_inc(&mx->running);
+	}
+
+	for_each_cpu(cpu, &mx->cpus) {
+		s = &mx->slot[cpu];
+		cpus_read_lock();
+		if (!cpu_online(cpu)) {
+			s->gone = true;
+			jit_cpu_done(s);
+		} else if (hr) {
+			smp_call_function_single(cpu, jit_cpu_hrtimer_start, s, 1);
+		} else {
+			s->expected = ktime_get_ns() + jiffies_to_nsecs(mx->tj);
+			s->timer.expires = jiffies + mx->tj;
+			add_timer_on(&s->timer, cpu);
+		}
+		cpus_read_unlock();
+	}
+
+	if (wait_event_interruptible(mx->wait, !atomic_read(&mx->running)))
+		ret = -ERESTARTSYS;
+
+	/** stop re-arming and wait for callbacks still running */
+	WRITE_ONCE(mx->stop, true);
+	for_each_cpu(cpu, &mx->cpus) {
+		s = &mx->slot[cpu];
+		if (hr)
+			hrtimer_cancel(&s->hrtimer);
+		else
+			del_timer_sync(&s->timer);
+	}
+
+	if (!ret)
+		jit_cpumatrix_render(m, mx, hr);
+
+	kfree(mx);
+	return ret;
+}
+
+static int jit_cpumatrix_open(struct inode *inode, struct file *file)
+{
+	/** size the buffer up front, a seq_file overflow reruns the show */
+	return single_open_size(file, jit_cpumatrix_show, pde_data(inode),
+				(num_possible_cpus() + 4) * 320);
+}
+
+static struct proc_ops jit_cpumatrix_fops = {
+	.proc_open		= jit_cpumatrix_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * Background latency monitor: a pinned hrtimer on every online cpu
+ * samples its own lateness every monperiod ns into a per-cpu ring.
+ * Each ring has one producer (its cpu's timer) and one consumer (a
+ * reader holding jit_mon_rd), so it needs no lock. When a ring is full
+ * new samples are dropped and counted in the next sample's lost field.
+ *
+ * /proc/jitmonitor streams the samples as text through a seq_file
+ * iterator, oldest first across cpus, and blocks for more unless
+ * O_NONBLOCK or the monitor is stopped. /proc/jitmonitor_bin returns
+ * the same samples as struct jit_mon_sample records.
+ */
+#define JIT_MON_RING	4096	/** power of 2 */
+#define JIT_MON_WAKE	64	/** wake readers every JIT_MON_WAKE samples */
+
+struct jit_mon_sample {
+	u64 ts;		/** expiry, ktime_get() ns */
+	u64 late;	/** lateness ns */
+	u32 cpu;
+	u32 lost;	/** samples dropped on this cpu before this one */
+};
+
+struct jit_monring {
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+	int cpu;
+	struct hrtimer timer;
+	struct jit_mon_sample buf[JIT_MON_RING];
+};
+
+static struct jit_monring **jit_mon;
+static struct jit_monring *jit_mon_cur;
+static ktime_t jit_mon_period;
+static bool jit_mon_running;
+static DEFINE_MUTEX(jit_mon_ctl);	/** start/stop */
+static DEFINE_MUTEX(jit_mon_rd);	/** ring consumers */
+static DECLARE_WAIT_QUEUE_HEAD(jit_mon_wait);
+
+static enum hrtimer_restart jit_mon_fn(struct hrtimer *t)
+{
+	struct jit_monring *r = container_of(t, struct jit_monring, timer);
+	ktime_t now = ktime_get();
+	s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(t)));
+	unsigned int head = r->head;
+	unsigned int used = head - smp_load_acquire(&r->tail);
+	struct jit_mon_sample *s;
+
+	/** migrated away by cpu hotplug, keep one producer per ring */
+	if (r->cpu != smp_processor_id())
+		return HRTIMER_NORESTART;
+
+	if (used >= JIT_MON_RING) {
+		r->dropped++;
+	} else {
+		s = &r->buf[head & (JIT_MON_RING - 1)];
+		s->ts = ktime_to_ns(now);
+		s->late = late > 0 ? late : 0;
+		s->cpu = r->cpu;
+		s->lost = r->dropped;
+		r->dropped = 0;
+		smp_store_release(&r->head, head + 1);
+		if (used + 1 >= JIT_MON_WAKE && wq_has_sleeper(&jit_mon_wait))
+			wake_up_interruptible(&jit_mon_wait);
+	}
+
+	hrtimer_forward(t, now, jit_mon_period);
+	return HRTIMER_RESTART;
+}
+
+static bool jit_mon_pending(void)
+{
+	int cpu;
+
+	if (!jit_mon)
+		return false;
+	for_each_possible_cpu(cpu) {
+		struct jit_monring *r = jit_mon[cpu];
+
+		if (smp_load_acquire(&r->head) != r->tail)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Oldest unread sample across cpus, called with jit_mon_rd held
+ */
+static struct jit_mon_sample *jit_mon_peek(void)
+{
+	struct jit_mon_sample *s, *oldest = NULL;
+	int cpu;
+
+	jit_mon_cur = NULL;
+	if (!jit_mon)
+		return NULL;
+
+	for_each_possible_cpu(cpu) {
+		struct jit_monring *r = jit_mon[cpu];
+
+		if (smp_load_acquire(&r->head) == r->tail)
+			continue;
+		s = &r->buf[r->tail & (JIT_MON_RING - 1)];
+		if (!oldest || s->ts < oldest->ts) {
+			oldest = s;
+			jit_mon_cur = r;
+		}
+	}
+	return oldest;
+}
+
+static void jit_mon_consume(void)
+{
+	smp_store_release(&jit_mon_cur->tail, jit_mon_cur->tail + 1);
+}
+
+/**
+ * Wait for samples without holding jit_mon_rd, returns 1 when there
+ * is nothing left to wait for
+ */
+static int jit_mon_wait_data(struct file *file)
+{
+	if (!READ_ONCE(jit_mon_running))
+		return 1;
+	if (file->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+	if (wait_event_interruptible(jit_mon_wait,
+			jit_mon_pending() || !READ_ONCE(jit_mon_running)))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+static void *jit_mon_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct jit_mon_sample *s;
+	int ret;
+
+	for (;;) {
+		mutex_lock(&jit_mon_rd);
+		s = jit_mon_peek();
+		if (s)
+			return s;
+		mutex_unlock(&jit_mon_rd);
+
+		ret = jit_mon_wait_data(m->file);
+		if (ret) {
+			mutex_lock(&jit_mon_rd);
+			/** -EAGAIN reads as end of file for text readers */
+			return ret < 0 && ret != -EAGAIN ? ERR_PTR(ret) : NULL;
+		}
+	}
+}
+
+/**
+ * The sample passed in has been shown, consume it and peek the next
+ * one. An empty ring ends this read() and the next one blocks in start.
+ */
+static void *jit_mon_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	jit_mon_consume();
+	++*pos;
+	return jit_mon_peek();
+}
+
+static void jit_mon_seq_stop(struct seq_file *m, void *v)
+{
+	mutex_unlock(&jit_mon_rd);
+}
+
+static int jit_mon_seq_show(struct seq_file *m, void *v)
+{
+	struct jit_mon_sample *s = v;
+	u32 rem;
+	u64 sec = div_u64_rem(s->ts, NSEC_PER_SEC, &rem);
+
+	seq_printf(m, "%llu.%09u cpu %3u late %9llu ns", sec, rem,
+			s->cpu, s->late);
+	if (s->lost)
+		seq_printf(m, " lost %u", s->lost);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static const struct seq_operations jit_mon_seq_ops = {
+	.start	= jit_mon_seq_start,
+	.next	= jit_mon_seq_next,
+	.stop	= jit_mon_seq_stop,
+	.show	= jit_mon_seq_show,
+};
+
+static ssize_t jit_mon_bin_read(struct file *file, char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct jit_mon_sample *s;
+	size_t done = 0;
+	int ret;
+
+	if (count < sizeof(*s))
+		return -EINVAL;
+
+	for (;;) {
+		if (mutex_lock_interruptible(&jit_mon_rd))
+			return -ERESTARTSYS;
+		while (count - done >= sizeof(*s) && (s = jit_mon_peek())) {
+			if (copy_to_user(buf + done, s, sizeof(*s))) {
+				mutex_unlock(&jit_mon_rd);
+				return done ? done : -EFAULT;
+			}
+			jit_mon_consume();
+			done += sizeof(*s);
+		}
+		mutex_unlock(&jit_mon_rd);
+
+		if (done)
+			return done;
+		ret = jit_mon_wait_data(file);
+		if (ret)
+			return ret < 0 ? ret : 0;
+	}
+}
+
+static void jit_mon_start_cpu(void *info)
+{
+	struct jit_monring *r = info;
+
+	hrtimer_start(&r->timer, jit_mon_period, HRTIMER_MODE_REL_PINNED);
+}
+
+static void jit_mon_free(void)
+{
+	int cpu;
+
+	if (!jit_mon)
+		return;
+	for_each_possible_cpu(cpu)
+		kvfree(jit_mon[cpu]);
+	kfree(jit_mon);
+	jit_mon = NULL;
+}
+
+/**
+ * Rings are allocated on first start and kept until unload, so the
+ * samples left after a stop can still be read.
+ */
+static int jit_mon_alloc(void)
+{
+	struct jit_monring *r;
+	int cpu;
+
+	jit_mon = kcalloc(nr_cpu_ids, sizeof(*jit_mon), GFP_KERNEL);
+	if (!jit_mon)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		r = kvzalloc_node(sizeof(*r), GFP_KERNEL, cpu_to_node(cpu));
+		if (!r) {
+			jit_mon_free();
+			return -ENOMEM;
+		}
+		r->cpu = cpu;
+		hrtimer_init(&r->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		r->timer.function = jit_mon_fn;
+		jit_mon[cpu] = r;
+	}
+	return 0;
+}
+
+static int jit_mon_start_all(void)
+{
+	int cpu, ret = 0;
+
+	mutex_lock(&jit_mon_ctl);
+	if (jit_mon_running)
+		goto out;
+	if (!jit_mon) {
+		ret = jit_mon_alloc();
+		if (ret)
+			goto out;
+	}
+
+	jit_mon_period = ns_to_ktime(max_t(ulong, monperiod, JIT_HRPERIOD_MIN));
+	WRITE_ONCE(jit_mon_running, true);
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu)
+		smp_call_function_single(cpu, jit_mon_start_cpu, jit_mon[cpu], 1);
+	cpus_read_unlock();
+	pr_info("jit monitor started, period %lld ns\n",
+			ktime_to_ns(jit_mon_period));
+out:
+	mutex_unlock(&jit_mon_ctl);
+	return ret;
+}
+
+static void jit_mon_stop_all(void)
+{
+	int cpu;
+
+	mutex_lock(&jit_mon_ctl);
+	if (jit_mon_running) {
+		WRITE_ONCE(jit_mon_running, false);
+		for_each_possible_cpu(cpu)
+			hrtimer_cancel(&jit_mon[cpu]->timer);
+		wake_up_interruptible(&jit_mon_wait);
+		pr_info("jit monitor stopped\n");
+	}
+	mutex_unlock(&jit_mon_ctl);
+}
+
+static ssize_t jit_mon_write(struct file *file, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	bool on;
+	int ret;
+
+	ret = kstrtobool_from_user(buf, count, &on);
+	if (ret)
+		return ret;
+
+	if (on)
+		ret = jit_mon_start_all();
+	else
+		jit_mon_stop_all();
+
+	return ret ? ret : count;
+}
+
+static int jit_mon_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &jit_mon_seq_ops);
+}
+
+static struct proc_ops jit_mon_fops = {
+	.proc_open		= jit_mon_open,
+	.proc_read		= seq_read,
+	.proc_write		= jit_mon_write,
+	.proc_release	= seq_release,
+};
+
+static struct proc_ops jit_mon_bin_fops = {
+	.proc_read		= jit_mon_bin_read,
+	.proc_write		= jit_mon_write,
+};
+
+/**
+ * Compare bottom half mechanisms. In the latency run an hrtimer plays
+ * the top half: every hrperiod ns it queues the bottom half from hard
+ * irq, unless the previous one has not run yet (counted as missed),
+ * and the bottom half records the queue to run latency. In the chain
+ * run the bottom half requeues itself back to back, which gives the
+ * throughput. The SCHED_FIFO kthread is a kthread_worker so it can be
+ * queued from hard irq like the others.
+ */
+enum jit_defer_kind {
+	JIT_DEFER_TASKLET = 0,
+	JIT_DEFER_TASKLET_HI,
+	JIT_DEFER_IRQ_WORK,
+	JIT_DEFER_HIGHPRI_WQ,
+	JIT_DEFER_FIFO_KTHREAD,
+	JIT_NR_DEFER
+};
+
+static const char * const jit_defer_names[JIT_NR_DEFER] = {
+	[JIT_DEFER_TASKLET]	= "tasklet",
+	[JIT_DEFER_TASKLET_HI]	= "tasklet_hi",
+	[JIT_DEFER_IRQ_WORK]	= "irq_work",
+	[JIT_DEFER_HIGHPRI_WQ]	= "highpri_wq",
+	[JIT_DEFER_FIFO_KTHREAD] = "fifo_kthread",
+};
+
+struct jit_defer {
+	int kind;
+	struct tasklet_struct tlet;
+	struct irq_work iw;
+	struct work_struct work;
+	struct kthread_worker *kworker;
+	struct kthread_work kwork;
+	struct hrtimer timer;
+	ktime_t period;
+	struct lat_hist hist;
+	struct completion done;
+	u64 t_queue;
+	int left;
+	bool chain;
+	bool busy;
+	bool stop;
+	unsigned long missed;
+};
+
+static void jit_defer_queue(struct jit_defer *d)
+{
+	switch (d->kind) {
+	case JIT_DEFER_TASKLET:
+		tasklet_schedule(&d->tlet);
+		break;
+	case JIT_DEFER_TASKLET_HI:
+		tasklet_hi_schedule(&d->tlet);
+		break;
+	case JIT_DEFER_IRQ_WORK:
+		irq_work_queue(&d->iw);
+		break;
+	case JIT_DEFER_HIGHPRI_WQ:
+		queue_work(system_highpri_wq, &d->work);
+		break;
+	case JIT_DEFER_FIFO_KTHREAD:
+		kthread_queue_work(d->kworker, &d->kwork);
+		break;
+	}
+}
+
+static void jit_defer_run(struct jit_defer *d)
+{
+	u64 now = ktime_get_ns();
+
+	lat_hist_add(&d->hist, now - d->t_queue);
+
+	if (--d->left <= 0 || READ_ONCE(d->stop)) {
+		WRITE_ONCE(d->stop, true);
+		complete(&d->done);
+		return;
+	}
+
+	if (d->chain) {
+		d->t_queue = ktime_get_ns();
+		jit_defer_queue(d);
+	} else {
+		WRITE_ONCE(d->busy, false);
+	}
+}
+
+static void jit_defer_tasklet(unsigned long arg)
+{
+	jit_defer_run((struct jit_defer *)arg);
+}
+
+static void jit_defer_irq_work(struct irq_work *w)
+{
+	jit_defer_run(container_of(w, struct jit_defer, iw));
+}
+
+static void jit_defer_work(struct work_struct *w)
+{
+	jit_defer_run(container_of(w, struct jit_defer, work));
+}
+
+static void jit_defer_kwork(struct kthread_work *w)
+{
+	jit_defer_run(container_of(w, struct jit_defer, kwork));
+}
+
+static enum hrtimer_restart jit_defer_timer_fn(struct hrtimer *t)
+{
+	struct jit_defer *d = container_of(t, struct jit_defer, timer);
+	ktime_t now = ktime_get();
+
+	if (READ_ONCE(d->stop))
+		return HRTIMER_NORESTART;
+
+	if (READ_ONCE(d->busy)) {
+		d->missed++;
+	} else {
+		WRITE_ONCE(d->busy, true);
+		d->t_queue = ktime_to_ns(now);
+		jit_defer_queue(d);
+	}
+
+	hrtimer_forward(t, now, d->period);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * Nothing may be left queued or running once this returns
+ */
+static void jit_defer_sync(struct jit_defer *d)
+{
+	WRITE_ONCE(d->stop, true);
+	hrtimer_cancel(&d->timer);
+	tasklet_kill(&d->tlet);
+	irq_work_sync(&d->iw);
+	cancel_work_sync(&d->work);
+	kthread_cancel_work_sync(&d->kwork);
+}
+
+static int jit_defer_measure(struct jit_defer *d, bool chain, u64 *elapsed)
+{
+	u64 t0;
+	int ret;
+
+	lat_hist_init(&d->hist);
+	reinit_completion(&d->done);
+	d->left = deferloops;
+	d->chain = chain;
+	d->busy = chain;
+	d->stop = false;
+	d->missed = 0;
+
+	t0 = ktime_get_ns();
+	if (chain) {
+		d->t_queue = t0;
+		jit_defer_queue(d);
+	} else {
+		hrtimer_start(&d->timer, d->period, HRTIMER_MODE_REL);
+	}
+
+	ret = wait_for_completion_interruptible(&d->done);
+	*elapsed = ktime_get_ns() - t0;
+	jit_defer_sync(d);
+	return ret;
+}
+
+int jit_deferbench_show(struct seq_file *m, void *v)
+{
+	struct jit_defer *d;
+	struct lat_hist *h;
+	u64 elapsed, chain_avg;
+	int kind, ret = 0;
+
+	if (deferloops <= 0)
+		return -EINVAL;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+
+	d->kworker = kthread_create_worker(0, "jitdefer");
+	if (IS_ERR(d->kworker)) {
+		ret = PTR_ERR(d->kworker);
+		kfree(d);
+		return ret;
+	}
+	sched_set_fifo(d->kworker->task);
+
+	tasklet_init(&d->tlet, jit_defer_tasklet, (unsigned long)d);
+	init_irq_work(&d->iw, jit_defer_irq_work);
+	INIT_WORK(&d->work, jit_defer_work);
+	kthread_init_work(&d->kwork, jit_defer_kwork);
+	hrtimer_init(&d->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	d->timer.function = jit_defer_timer_fn;
+	d->period = ns_to_ktime(max_t(ulong, hrperiod, JIT_HRPERIOD_MIN));
+	init_completion(&d->done);
+	h = &d->hist;
+
+	seq_printf(m, "%d runs each, top half every %lld ns\n",
+			deferloops, ktime_to_ns(d->period));
+	seq_puts(m, "        kind  min(ns)  avg(ns)  max(ns)    p99 <   missed"
+			"  chain avg(ns)  chain runs/s\n");
+
+	for (kind = 0; kind < JIT_NR_DEFER; kind++) {
+		d->kind = kind;
+		seq_printf(m, "%12s", jit_defer_names[kind]);
+
+		ret = jit_defer_measure(d, false, &elapsed);
+		if (ret)
+			break;
+		seq_printf(m, " %8llu %8llu %8llu %8llu %8lu", h->min,
+				div64_u64(h->sum, h->count), h->max,
+				lat_hist_pct(h, 99), d->missed);
+
+		ret = jit_defer_measure(d, true, &elapsed);
+		if (ret)
+			break;
+		chain_avg = div64_u64(h->sum, h->count);
+		seq_printf(m, " %14llu %13llu\n", chain_avg,
+				div64_u64(h->count * NSEC_PER_SEC, elapsed ? elapsed : 1));
+	}
+
+	kthread_destroy_worker(d->kworker);
+	kfree(d);
+	return ret;
+}
+
+static int jit_deferbench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jit_deferbench_show, NULL);
+}
+
+static struct proc_ops jit_deferbench_fops = {
+	.proc_open		= jit_deferbench_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * /dev/jitclock: the values of currentime in a page userspace can mmap
+ * read-only and read with no syscall. An hrtimer rewrites the page
+ * every clkperiod ns under a seqcount (see jitclock.h), and only runs
+ * while the device is open or mapped.
+ */
+#define JIT_CLOCK_NAME		"jitclock"
+#define JIT_CLOCK_CLASS		"jitclockclass"
+
+static dev_t jit_clock_devnr;
+static struct class *jit_clock_class;
+static struct cdev jit_clock_cdev;
+static struct jitclock_page *jit_clock_page;
+static struct hrtimer jit_clock_timer;
+static ktime_t jit_clock_period;
+static DEFINE_MUTEX(jit_clock_lock);
+static int jit_clock_users;
+
+static void jit_clock_update(void)
+{
+	struct jitclock_page *p = jit_clock_page;
+	struct timespec64 ts;
+
+	ktime_get_coarse_real_ts64(&ts);
+
+	WRITE_ONCE(p->seq, p->seq + 1);
+	smp_wmb();
+	p->jiffies = get_jiffies_64();
+	p->coarse_real_ns = timespec64_to_ns(&ts);
+	p->mono_ns = ktime_get_ns();
+	p->updates++;
+	smp_wmb();
+	WRITE_ONCE(p->seq, p->seq + 1);
+}
+
+static enum hrtimer_restart jit_clock_fn(struct hrtimer *t)
+{
+	jit_clock_update();
+	hrtimer_forward_now(t, jit_clock_period);
+	return HRTIMER_RESTART;
+}
+
+static void jit_clock_get(void)
+{
+	mutex_lock(&jit_clock_lock);
+	if (!jit_clock_users++) {
+		jit_clock_update();
+		hrtimer_start(&jit_clock_timer, jit_clock_period,
+				HRTIMER_MODE_REL);
+	}
+	mutex_unlock(&jit_clock_lock);
+}
+
+static void jit_clock_put(void)
+{
+	mutex_lock(&jit_clock_lock);
+	if (!--jit_clock_users)
+		hrtimer_cancel(&jit_clock_timer);
+	mutex_unlock(&jit_clock_lock);
+}
+
+/**
+ * A mapping outlives the file, so it holds its own reference
+ */
+static void jit_clock_vm_open(struct vm_area_struct *vma)
+{
+	jit_clock_get();
+}
+
+static void jit_clock_vm_close(struct vm_area_struct *vma)
+{
+	jit_clock_put();
+}
+
+static const struct vm_operations_struct jit_clock_vm_ops = {
+	.open	= jit_clock_vm_open,
+	.close	= jit_clock_vm_close,
+};
+
+static int jit_clock_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	ret = remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(jit_clock_page) >> PAGE_SHIFT,
+			PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &jit_clock_vm_ops;
+	jit_clock_get();
+	return 0;
+}
+
+static int jit_clock_open(struct inode *inode, struct file *filp)
+{
+	jit_clock_get();
+	return 0;
+}
+
+static int jit_clock_release(struct inode *inode, struct file *filp)
+{
+	jit_clock_put();
+	return 0;
+}
+
+static struct file_operations jit_clock_fops = {
+	.owner = THIS_MODULE,
+	.open = jit_clock_open,
+	.release = jit_clock_release,
+	.mmap = jit_clock_mmap,
+};
+
+static int __init jit_clock_init(void)
+{
+	struct device *device;
+	int ret;
+
+	jit_clock_page = (struct jitclock_page *)get_zeroed_page(GFP_KERNEL);
+	if (!jit_clock_page)
+		return -ENOMEM;
+
+	jit_clock_period = ns_to_ktime(max_t(ulong, clkperiod, JIT_HRPERIOD_MIN));
+	hrtimer_init(&jit_clock_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	jit_clock_timer.function = jit_clock_fn;
+
+	ret = alloc_chrdev_region(&jit_clock_devnr, 0, 1, JIT_CLOCK_NAME);
+	if (ret < 0) {
+		pr_err("failed to allocate device numbers: %d\n", ret);
+		goto err_free_page;
+	}
+
+	jit_clock_class = class_create(THIS_MODULE, JIT_CLOCK_CLASS);
+	if (IS_ERR(jit_clock_class)) {
+		ret = PTR_ERR(jit_clock_class);
+		pr_err("failed to create class: %d\n", ret);
+		goto err_unregister_chrdev;
+	}
+
+	device = device_create(jit_clock_class, NULL, jit_clock_devnr, NULL,
+				JIT_CLOCK_NAME);
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		pr_err("Could not create device: %d\n", ret);
+		goto err_destruct_class;
+	}
+
+	cdev_init(&jit_clock_cdev, &jit_clock_fops);
+	ret = cdev_add(&jit_clock_cdev, jit_clock_devnr, 1);
+	if (ret) {
+		pr_err("Could not register char dev: %d\n", ret);
+		goto err_destruct_device;
+	}
+	return 0;
+
+err_destruct_device:
+	device_destroy(jit_clock_class, jit_clock_devnr);
+err_destruct_class:
+	class_destroy(jit_clock_class);
+err_unregister_chrdev:
+	unregister_chrdev_region(jit_clock_devnr, 1);
+err_free_page:
+	free_page((unsigned long)jit_clock_page);
+	return ret;
+}
+
+static void jit_clock_exit(void)
+{
+	cdev_del(&jit_clock_cdev);
+	device_destroy(jit_clock_class, jit_clock_devnr);
+	class_destroy(jit_clock_class);
+	unregister_chrdev_region(jit_clock_devnr, 1);
+	hrtimer_cancel(&jit_clock_timer);
+	free_page((unsigned long)jit_clock_page);
+}
+
 int __init jit_init(void)
 {
+	int ret;
+
+	ret = jit_clock_init();
+	if (ret)
+		return ret;
+
 	proc_create_data("currentime", 0, NULL, &jit_currentime_fops, NULL);
 
 	proc_create_data("jitbusy", 0, NULL, &jit_fn_fops, (void *)JIT_BUSY);
 	proc_create_data("jitsched", 0, NULL, &jit_fn_fops, (void *)JIT_SCHED);
 	proc_create_data("jitqueue", 0, NULL, &jit_fn_fops, (void *)JIT_QUEUE);
 	proc_create_data("jitschedto", 0, NULL, &jit_fn_fops, (void *)JIT_SCHEDTO);
+	proc_create_data("jitdelaybench", 0, NULL, &jit_delaybench_fops, NULL);
 
 	proc_create_data("jitimer", 0, NULL, &jit_timer_fops, NULL);
+	proc_create_data("jithrtimer", 0, NULL, &jit_hrtimer_fops, NULL);
+	proc_create_data("jitcpumatrix", 0, NULL, &jit_cpumatrix_fops, NULL);
+	proc_create_data("jitcpuhrmatrix", 0, NULL, &jit_cpumatrix_fops, (void *)1);
 	proc_create_data("jitasklet", 0, NULL, &jit_tasklet_fops, NULL);
 	proc_create_data("jitasklethi", 0, NULL, &jit_tasklet_fops, (void *)1);
+	proc_create_data("jitdeferbench", 0, NULL, &jit_deferbench_fops, NULL);
+
+	proc_create_data("jitmonitor", 0644, NULL, &jit_mon_fops, NULL);
+	proc_create_data("jitmonitor_bin", 0644, NULL, &jit_mon_bin_fops, NULL);
+	if (monitor && jit_mon_start_all())
+		pr_err("could not start jit monitor\n");
 
 	return 0;
 }
@@ -302,10 +1574,22 @@ void __exit jit_cleanup(void)
 	remove_proc_entry("jitsched", NULL);
 	remove_proc_entry("jitqueue", NULL);
 	remove_proc_entry("jitschedto", NULL);
+	remove_proc_entry("jitdelaybench", NULL);
 
 	remove_proc_entry("jitimer", NULL);
+	remove_proc_entry("jithrtimer", NULL);
+	remove_proc_entry("jitcpumatrix", NULL);
+	remove_proc_entry("jitcpuhrmatrix", NULL);
 	remove_proc_entry("jitasklet", NULL);
 	remove_proc_entry("jitasklethi", NULL);
+	remove_proc_entry("jitdeferbench", NULL);
+
+	jit_mon_stop_all();
+	remove_proc_entry("jitmonitor", NULL);
+	remove_proc_entry("jitmonitor_bin", NULL);
+	jit_mon_free();
+
+	jit_clock_exit();
 }
 
 module_init(jit_init);
@@ -0,0 +1,103 @@
+/**
+ * Compare reading /dev/jitclock against clock_gettime() (vDSO).
+ * gcc -O2 -o jitclock-bench jitclock-bench.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "jitclock.h"
+
+#define NR_LOOPS	(10000000)
+
+/** keeps the timed loops from being optimized out */
+static volatile uint64_t sink;
+
+static uint64_t ts_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t page_mono_ns(const struct jitclock_page *p)
+{
+	uint32_t seq;
+	uint64_t ns;
+
+	do {
+		seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+		ns = p->mono_ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&p->seq, __ATOMIC_RELAXED));
+
+	return ns;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct jitclock_page *p;
+	uint64_t t0, t1, sum, lag, lag_max = 0, lag_sum = 0;
+	long loops = argc > 1 ? atol(argv[1]) : NR_LOOPS;
+	long i;
+	int fd;
+
+	if (loops <= 0)
+		loops = NR_LOOPS;
+
+	fd = open(JITCLOCK_DEVICE, O_RDONLY);
+	if (fd < 0) {
+		printf("Can't open %s\n", JITCLOCK_DEVICE);
+		return 1;
+	}
+	p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		printf("Can't mmap %s\n", JITCLOCK_DEVICE);
+		close(fd);
+		return 1;
+	}
+
+	/** cost per read */
+	sum = 0;
+	t0 = ts_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < loops; i++)
+		sum += page_mono_ns(p);
+	t1 = ts_ns(CLOCK_MONOTONIC);
+	printf("jitclock page        %6.2f ns/read\n", (double)(t1 - t0) / loops);
+
+	t0 = ts_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < loops; i++)
+		sum += ts_ns(CLOCK_MONOTONIC);
+	t1 = ts_ns(CLOCK_MONOTONIC);
+	printf("CLOCK_MONOTONIC      %6.2f ns/read\n", (double)(t1 - t0) / loops);
+
+	t0 = ts_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < loops; i++)
+		sum += ts_ns(CLOCK_MONOTONIC_COARSE);
+	t1 = ts_ns(CLOCK_MONOTONIC);
+	printf("CLOCK_MONOTONIC_COARSE %4.2f ns/read\n", (double)(t1 - t0) / loops);
+
+	/** how far the page lags behind CLOCK_MONOTONIC */
+	for (i = 0; i < loops; i++) {
+		uint64_t pg = page_mono_ns(p);
+
+		t0 = ts_ns(CLOCK_MONOTONIC);
+		lag = t0 > pg ? t0 - pg : 0;
+		lag_sum += lag;
+		if (lag > lag_max)
+			lag_max = lag;
+	}
+	sink = sum;
+	printf("page lag avg %llu ns max %llu ns, %llu updates\n",
+		(unsigned long long)(lag_sum / loops),
+		(unsigned long long)lag_max,
+		(unsigned long long)p->updates);
+
+	munmap((void *)p, sizeof(*p));
+	close(fd);
+	return 0;
+}
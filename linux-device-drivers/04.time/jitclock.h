@@ -0,0 +1,23 @@
+#ifndef _JITCLOCK_H
+#define _JITCLOCK_H
+
+#include <linux/types.h>
+
+#define JITCLOCK_DEVICE		"/dev/jitclock"
+
+/**
+ * Layout of the page mapped read-only from /dev/jitclock. The kernel
+ * rewrites it every clkperiod ns, seq is odd while it does. Readers
+ * load seq (acquire), retry while it is odd, copy the fields, then
+ * fence (acquire) and retry if seq changed.
+ */
+struct jitclock_page {
+	__u32 seq;
+	__u32 pad;
+	__u64 jiffies;		/** jiffies_64 */
+	__u64 coarse_real_ns;	/** ktime_get_coarse_real_ts64() */
+	__u64 mono_ns;		/** ktime_get_ns() */
+	__u64 updates;
+};
+
+#endif /* _JITCLOCK_H */
@@ -32,6 +32,18 @@
 #include <linux/workqueue.h>
 #include <linux/preempt.h>
 #include <linux/interrupt.h>	/** tasklets */
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/topology.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <uapi/linux/sched/types.h>
+#include "lathist.h"
 
 
 MODULE_LICENSE("Dual BSD/GPL");
@@ -42,70 +54,272 @@ MODULE_LICENSE("Dual BSD/GPL");
 static long delay = 1;
 module_param(delay, long, 0);
 
+/**
+ * /proc/jiqwqbench: items queued per producer, the largest number of
+ * producer threads and the payload costs (ns of busy work per item).
+ */
+#define JIQ_MAX_PAYLOADS	8
+static int wqitems = 2000;
+module_param(wqitems, int, 0);
+static int wqproducers = 8;
+module_param(wqproducers, int, 0);
+static ulong wqpayload[JIQ_MAX_PAYLOADS] = {0, 1000, 10000};
+static int nr_wqpayload = 3;
+module_param_array(wqpayload, ulong, &nr_wqpayload, 0);
+
+/**
+ * /proc/jiqwqload: round trips per concurrent requester
+ */
+static int wqloads = 1000;
+module_param(wqloads, int, 0);
+
+/**
+ * /proc/jiqfanout: work items fanned out per run
+ */
+static int fanitems = 4096;
+module_param(fanitems, int, 0);
+
+/**
+ * /proc/jiqkthread worker: SCHED_FIFO priority (0 keeps it
+ * SCHED_NORMAL) and the cpu it is bound to (-1 for any).
+ */
+static int kwprio = 50;
+module_param(kwprio, int, 0);
+static int kwcpu = -1;
+module_param(kwcpu, int, 0);
+
+/**
+ * /proc/jiqslack: timers armed per run, the window their random
+ * deadlines fall into (ms) and the slack allowed to the coalescing
+ * modes (us).
+ */
+static int slackitems = 2000;
+module_param(slackitems, int, 0);
+static int slackspan = 1000;
+module_param(slackspan, int, 0);
+static int slackus = 10000;
+module_param(slackus, int, 0);
+
 /**
  * This module is a silly one: it only embeds short code fragments
  * that show how enqueued tasks `feel' the environment
  */
 
-#define LIMIT	(PAGE_SIZE-128)	/* don't print any more after this size */
+/**
+ * Samples taken per read of jiqwq, jiqwqdelay and jiqtasklet.
+ */
+static int jiqsamples = 100;
+module_param(jiqsamples, int, 0);
 
 /**
- * Print information about the current environment. This is called from
- * within the task queues. If the limit is reched, awake the reading
- * process.
+ * The deferred contexts only store a fixed-size sample, the text is
+ * formatted later in the reader's context so printing does not add
+ * to the latency being measured.
  */
-static DECLARE_WAIT_QUEUE_HEAD(jiq_wait);
+struct jiq_sample {
+	unsigned long jiffies;
+	u64 ns;
+	int preempt;
+	pid_t pid;
+	int cpu;
+	char comm[TASK_COMM_LEN];
+};
 
 /**
- * Keep track of info we need between task queue runs.
+ * Keep track of info we need between task queue runs. Every open of a
+ * jiq file gets its own, so concurrent readers measure independently.
+ * Only one deferred context of a client runs at a time, so its sample
+ * buffer needs no locking.
  */
-static struct clientdata {
+struct clientdata {
 	struct work_struct jiq_work;
 	struct delayed_work jiq_delayed_work;
 	struct timer_list jiq_timer;
 	struct tasklet_struct jiq_tasklet;
-	struct seq_file *m;
-	int len;
+	struct kthread_work jiq_kwork;
+	int (*run)(struct clientdata *);
+	struct jiq_sample *samples;
+	unsigned int nr;
+	unsigned int max;
+	wait_queue_head_t wait;
 	unsigned long jiffies;
+	u64 ns;
 	long delay;
-} jiq_data;
+	bool ran;
+	bool done;
+	bool stop;
+};
 
+static void jiq_print_wq(struct work_struct *work);
+static void jiq_print_wq_delayed(struct work_struct *work);
 static void jiq_print_tasklet(unsigned long);
+static void jiq_timedout(struct timer_list *t);
+static void jiq_print_kwork(struct kthread_work *work);
+
+static struct kthread_worker *jiq_kworker;
 
 /**
- * Do the printing; return non-zero if the task should be rescheduled.
+ * Record the current environment. This is called from within the task
+ * queues. If the buffer is full, awake the reading process.
+ * Return non-zero if the task should be rescheduled.
  */
 static int jiq_print(struct clientdata *data)
 {
-	int len = data->len;
-	struct seq_file *m = data->m;
-	unsigned long j = jiffies;
+	struct jiq_sample *s;
 
-	if (len > LIMIT) {
-		wake_up_interruptible(&jiq_wait);
+	if (data->nr >= data->max || READ_ONCE(data->stop)) {
+		WRITE_ONCE(data->done, true);
+		wake_up_interruptible(&data->wait);
 		return 0;
 	}
 
-	if (len == 0) {
-		seq_puts(m, "    time  delta preempt   pid cpu command\n");
-		len = m->count;
+	s = &data->samples[data->nr++];
+	s->jiffies = jiffies;
+	s->ns = ktime_get_ns();
+	s->preempt = preempt_count();
+	s->pid = current->pid;
+	s->cpu = smp_processor_id();
+	memcpy(s->comm, current->comm, TASK_COMM_LEN);
+	return 1;
+}
+
+/**
+ * Nothing of this client may run once this returns, also after a
+ * signal woke the reader early.
+ */
+static void jiq_client_stop(struct clientdata *data)
+{
+	WRITE_ONCE(data->stop, true);
+	cancel_work_sync(&data->jiq_work);
+	cancel_delayed_work_sync(&data->jiq_delayed_work);
+	del_timer_sync(&data->jiq_timer);
+	tasklet_kill(&data->jiq_tasklet);
+	kthread_cancel_work_sync(&data->jiq_kwork);
+}
+
+static int jiq_client_run(struct clientdata *data)
+{
+	int ret;
+
+	data->nr = 0;			/** nothing recorded, yet */
+	data->jiffies = jiffies;	/** initial time */
+	data->ns = ktime_get_ns();
+	data->done = false;
+	data->stop = false;
+
+	ret = data->run(data);
+	jiq_client_stop(data);
+	data->ran = !ret;
+	return ret;
+}
+
+/**
+ * The first start() of an open runs the measurement, the samples are
+ * then walked one per record.
+ */
+static void *jiq_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct clientdata *data = m->private;
+	int ret;
+
+	if (!*pos && !data->ran) {
+		ret = jiq_client_run(data);
+		if (ret)
+			return ERR_PTR(ret);
+	}
+	if (*pos >= data->nr)
+		return NULL;
+	return &data->samples[*pos];
+}
+
+static void *jiq_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct clientdata *data = m->private;
+
+	if (++*pos >= data->nr)
+		return NULL;
+	return &data->samples[*pos];
+}
+
+static void jiq_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static int jiq_seq_show(struct seq_file *m, void *v)
+{
+	struct clientdata *data = m->private;
+	struct jiq_sample *s = v;
+	unsigned long prev_j = data->jiffies;
+	u64 prev_ns = data->ns;
+
+	if (s == data->samples) {
+		seq_puts(m, "    time  delta  delta(ns) preempt   pid cpu command\n");
 	} else {
-		len = 0;
+		prev_j = s[-1].jiffies;
+		prev_ns = s[-1].ns;
 	}
 
-	/** intr_count is only exported since 1.3.5,
-	   but 1.99.4 is needed anyways */
-	seq_printf(m, "%9li  %4li     %3i %5i %3i %s\n",
-			j, j - data->jiffies,
-			preempt_count(), current->pid, smp_processor_id(),
-			current->comm);
-	len += m->count;
+	seq_printf(m, "%9li  %4li %10llu     %3i %5i %3i %s\n",
+			s->jiffies, s->jiffies - prev_j, s->ns - prev_ns,
+			s->preempt, s->pid, s->cpu, s->comm);
+	return 0;
+}
 
-	data->len += len;
-	data->jiffies = j;
-	return 1;
+static const struct seq_operations jiq_seq_ops = {
+	.start	= jiq_seq_start,
+	.next	= jiq_seq_next,
+	.stop	= jiq_seq_stop,
+	.show	= jiq_seq_show,
+};
+
+static int jiq_client_open(struct file *file, int (*run)(struct clientdata *))
+{
+	struct clientdata *data;
+	int ret;
+
+	if (jiqsamples <= 0)
+		return -EINVAL;
+
+	data = kzalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	data->max = jiqsamples;
+	data->samples = kvmalloc_array(data->max, sizeof(*data->samples),
+					GFP_KERNEL);
+	if (!data->samples) {
+		kfree(data);
+		return -ENOMEM;
+	}
+
+	INIT_WORK(&data->jiq_work, jiq_print_wq);
+	INIT_DELAYED_WORK(&data->jiq_delayed_work, jiq_print_wq_delayed);
+	timer_setup(&data->jiq_timer, jiq_timedout, 0);
+	tasklet_init(&data->jiq_tasklet, jiq_print_tasklet,
+		(unsigned long)data);
+	kthread_init_work(&data->jiq_kwork, jiq_print_kwork);
+	init_waitqueue_head(&data->wait);
+	data->run = run;
+
+	ret = seq_open(file, &jiq_seq_ops);
+	if (ret) {
+		kvfree(data->samples);
+		kfree(data);
+		return ret;
+	}
+	((struct seq_file *)file->private_data)->private = data;
+	return 0;
 }
 
+static int jiq_client_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+	struct clientdata *data = m->private;
+
+	jiq_client_stop(data);
+	kvfree(data->samples);
+	kfree(data);
+	return seq_release(inode, file);
+}
 
 /**
  * Call jiq_print from a work queue
@@ -118,7 +332,7 @@ static void jiq_print_wq(struct work_struct *work)
 	if (!jiq_print(data))
 		return;
 
-	schedule_work(&jiq_data.jiq_work);
+	schedule_work(&data->jiq_work);
 }
 
 static void jiq_print_wq_delayed(struct work_struct *work)
@@ -129,66 +343,46 @@ static void jiq_print_wq_delayed(struct work_struct *work)
 	if (!jiq_print (data))
 		return;
 
-	schedule_delayed_work(&jiq_data.jiq_delayed_work, data->delay);
+	schedule_delayed_work(&data->jiq_delayed_work, data->delay);
 }
 
 
-static int jiq_read_wq_show(struct seq_file *m, void *v)
+static int jiq_read_wq_run(struct clientdata *data)
 {
-	DEFINE_WAIT(wait);
-
-	jiq_data.len = 0;			/** nothing printed, yet */
-	jiq_data.m = m;				/** print in this place */
-	jiq_data.jiffies = jiffies; /** initial time */
-	jiq_data.delay = 0;
-
-	prepare_to_wait(&jiq_wait, &wait, TASK_INTERRUPTIBLE);
-	schedule_work(&jiq_data.jiq_work);
-	schedule();
-	finish_wait(&jiq_wait, &wait);
-
-	return 0;
+	data->delay = 0;
+	schedule_work(&data->jiq_work);
+	return wait_event_interruptible(data->wait, READ_ONCE(data->done));
 }
 
 static int jiq_read_wq_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, jiq_read_wq_show, NULL);
+	return jiq_client_open(file, jiq_read_wq_run);
 }
 
 static struct proc_ops jiq_read_wq_fops = {
 	.proc_open		= jiq_read_wq_open,
 	.proc_read		= seq_read,
 	.proc_lseek		= seq_lseek,
-	.proc_release	= single_release,
+	.proc_release	= jiq_client_release,
 };
 
-static int jiq_read_wq_delayed_show(struct seq_file *m, void *v)
+static int jiq_read_wq_delayed_run(struct clientdata *data)
 {
-	DEFINE_WAIT(wait);
-
-	jiq_data.len = 0;                /** nothing printed, yet */
-	jiq_data.m = m;                  /** print in this place */
-	jiq_data.jiffies = jiffies;      /** initial time */
-	jiq_data.delay = delay;
-
-	prepare_to_wait(&jiq_wait, &wait, TASK_INTERRUPTIBLE);
-	schedule_delayed_work(&jiq_data.jiq_delayed_work, delay);
-	schedule();
-	finish_wait(&jiq_wait, &wait);
-
-	return 0;
+	data->delay = delay;
+	schedule_delayed_work(&data->jiq_delayed_work, delay);
+	return wait_event_interruptible(data->wait, READ_ONCE(data->done));
 }
 
 static int jiq_read_wq_delayed_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, jiq_read_wq_delayed_show, NULL);
+	return jiq_client_open(file, jiq_read_wq_delayed_run);
 }
 
 static struct proc_ops jiq_read_wq_delayed_fops = {
 	.proc_open		= jiq_read_wq_delayed_open,
 	.proc_read		= seq_read,
 	.proc_lseek		= seq_lseek,
-	.proc_release	= single_release,
+	.proc_release	= jiq_client_release,
 };
 
 /**
@@ -201,28 +395,23 @@ static void jiq_print_tasklet(unsigned long ptr)
 		tasklet_schedule(&data->jiq_tasklet);
 }
 
-static int jiq_read_tasklet_show(struct seq_file *m, void *v)
+static int jiq_read_tasklet_run(struct clientdata *data)
 {
-	jiq_data.len = 0;			/** nothing printed, yet */
-	jiq_data.m = m;				/** print in this place */
-	jiq_data.jiffies = jiffies;	/** initial time */
-
-	tasklet_schedule(&jiq_data.jiq_tasklet);
-	wait_event_interruptible(jiq_wait, 0);	/** sleep till completion */
-
-	return 0;
+	tasklet_schedule(&data->jiq_tasklet);
+	/** sleep till completion */
+	return wait_event_interruptible(data->wait, READ_ONCE(data->done));
 }
 
 static int jiq_read_tasklet_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, jiq_read_tasklet_show, NULL);
+	return jiq_client_open(file, jiq_read_tasklet_run);
 }
 
 static struct proc_ops jiq_read_tasklet_fops = {
 	.proc_open		= jiq_read_tasklet_open,
 	.proc_read		= seq_read,
 	.proc_lseek		= seq_lseek,
-	.proc_release	= single_release,
+	.proc_release	= jiq_client_release,
 };
 
 /**
@@ -232,36 +421,1111 @@ static struct proc_ops jiq_read_tasklet_fops = {
 static void jiq_timedout(struct timer_list *t)
 {
 	struct clientdata *data = from_timer(data, t, jiq_timer);
-	jiq_print(data);            /** print a line */
-	wake_up_interruptible(&jiq_wait);  /** awake the process */
+	jiq_print(data);            /** record a sample */
+	WRITE_ONCE(data->done, true);
+	wake_up_interruptible(&data->wait);  /** awake the process */
 }
 
-static int jiq_read_run_timer_show(struct seq_file *m, void *v)
+static int jiq_read_run_timer_run(struct clientdata *data)
 {
-	jiq_data.len = 0;           /** prepare the argument for jiq_print() */
-	jiq_data.m = m;
-	jiq_data.jiffies = jiffies;
-
-	timer_setup(&jiq_data.jiq_timer, jiq_timedout, 0);
-	jiq_data.jiq_timer.expires = jiffies + HZ; /** one second */
-
-	jiq_print(&jiq_data);   /** print and go to sleep */
-	add_timer(&jiq_data.jiq_timer);
-	wait_event_interruptible(jiq_wait, 0); /** RACE */
-	del_timer_sync(&jiq_data.jiq_timer);  /** in case a signal woke us up */
+	data->jiq_timer.expires = jiffies + HZ; /** one second */
 
-	return 0;
+	jiq_print(data);   /** record and go to sleep */
+	add_timer(&data->jiq_timer);
+	return wait_event_interruptible(data->wait, READ_ONCE(data->done));
 }
 
 static int jiq_read_run_timer_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, jiq_read_run_timer_show, NULL);
+	return jiq_client_open(file, jiq_read_run_timer_run);
 }
 
 static struct proc_ops jiq_read_run_timer_fops = {
 	.proc_open		= jiq_read_run_timer_open,
 	.proc_read		= seq_read,
 	.proc_lseek		= seq_lseek,
+	.proc_release	= jiq_client_release,
+};
+
+/**
+ * And this one a dedicated kthread_worker, optionally real-time and
+ * bound to one cpu, shared by all readers like the system workqueue.
+ */
+static void jiq_print_kwork(struct kthread_work *work)
+{
+	struct clientdata *data = container_of(work, struct clientdata,
+					jiq_kwork);
+
+	if (!jiq_print(data))
+		return;
+
+	kthread_queue_work(jiq_kworker, &data->jiq_kwork);
+}
+
+static int jiq_read_kthread_run(struct clientdata *data)
+{
+	kthread_queue_work(jiq_kworker, &data->jiq_kwork);
+	return wait_event_interruptible(data->wait, READ_ONCE(data->done));
+}
+
+static int jiq_read_kthread_open(struct inode *inode, struct file *file)
+{
+	return jiq_client_open(file, jiq_read_kthread_run);
+}
+
+static struct proc_ops jiq_read_kthread_fops = {
+	.proc_open		= jiq_read_kthread_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= jiq_client_release,
+};
+
+static int jiq_kworker_create(void)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = SCHED_FIFO,
+		.sched_priority = clamp(kwprio, 1, MAX_RT_PRIO - 1),
+	};
+	int ret;
+
+	if (kwcpu >= 0) {
+		if (kwcpu >= nr_cpu_ids || !cpu_online(kwcpu))
+			return -EINVAL;
+		jiq_kworker = kthread_create_worker_on_cpu(kwcpu, 0,
+						"jiqkworker/%d", kwcpu);
+	} else {
+		jiq_kworker = kthread_create_worker(0, "jiqkworker");
+	}
+	if (IS_ERR(jiq_kworker))
+		return PTR_ERR(jiq_kworker);
+
+	if (kwprio <= 0)
+		return 0;
+
+	ret = sched_setattr_nocheck(jiq_kworker->task, &attr);
+	if (ret) {
+		kthread_destroy_worker(jiq_kworker);
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * Workqueue flavor benchmark: producer threads, each bound to its own
+ * cpu, queue wqitems distinct work items as fast as they can. Every
+ * item records its queue to execution latency and then burns the
+ * payload. A run ends when all items have executed.
+ */
+enum jiq_wq_flavor {
+	JIQ_WQ_SYSTEM = 0,
+	JIQ_WQ_HIGHPRI,
+	JIQ_WQ_UNBOUND,
+	JIQ_WQ_CPU_INTENSIVE,
+	JIQ_WQ_ORDERED,
+	JIQ_NR_WQ
+};
+
+static const char * const jiq_wq_names[JIQ_NR_WQ] = {
+	[JIQ_WQ_SYSTEM]		= "system",
+	[JIQ_WQ_HIGHPRI]	= "highpri",
+	[JIQ_WQ_UNBOUND]	= "unbound",
+	[JIQ_WQ_CPU_INTENSIVE]	= "cpu_intensive",
+	[JIQ_WQ_ORDERED]	= "ordered",
+};
+
+struct jiq_bench {
+	struct workqueue_struct *wq;
+	struct lat_hist __percpu *hist;
+	atomic_t left;
+	struct completion done;
+	u64 payload;
+};
+
+struct jiq_item {
+	struct work_struct work;
+	struct jiq_bench *b;
+	u64 t_queue;
+};
+
+struct jiq_producer {
+	struct task_struct *task;
+	struct jiq_bench *b;
+	struct jiq_item *items;
+	int nr;
+};
+
+static void jiq_spin_ns(u64 ns)
+{
+	u64 end = ktime_get_ns() + ns;
+
+	while (ktime_get_ns() < end)
+		cpu_relax();
+}
+
+static void jiq_bench_work(struct work_struct *work)
+{
+	struct jiq_item *it = container_of(work, struct jiq_item, work);
+	struct jiq_bench *b = it->b;
+	u64 lat = ktime_get_ns() - it->t_queue;
+
+	lat_hist_add(get_cpu_ptr(b->hist), lat);
+	put_cpu_ptr(b->hist);
+
+	jiq_spin_ns(b->payload);
+
+	if (atomic_dec_and_test(&b->left))
+		complete(&b->done);
+}
+
+/**
+ * kthread_stop() needs the thread alive, so park until asked to stop
+ */
+static void jiq_wait_stop(void)
+{
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+static int jiq_producer_fn(void *arg)
+{
+	struct jiq_producer *p = arg;
+	int i;
+
+	for (i = 0; i < p->nr && !kthread_should_stop(); i++) {
+		p->items[i].t_queue = ktime_get_ns();
+		queue_work(p->b->wq, &p->items[i].work);
+	}
+
+	jiq_wait_stop();
+	return 0;
+}
+
+/**
+ * One run of nr_prod producers, returns items/s or a negative error
+ */
+static long long jiq_bench_run(struct jiq_bench *b, struct jiq_producer *prod,
+				int nr_prod, struct lat_hist *h)
+{
+	int i, j, cpu, ret = 0;
+	u64 t0, elapsed;
+
+	for_each_possible_cpu(cpu)
+		lat_hist_init(per_cpu_ptr(b->hist, cpu));
+	atomic_set(&b->left, nr_prod * wqitems);
+	reinit_completion(&b->done);
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < nr_prod; i++) {
+		prod[i].b = b;
+		prod[i].nr = wqitems;
+		for (j = 0; j < wqitems; j++) {
+			INIT_WORK(&prod[i].items[j].work, jiq_bench_work);
+			prod[i].items[j].b = b;
+		}
+		prod[i].task = kthread_create(jiq_producer_fn, &prod[i],
+						"jiqprod/%d", i);
+		if (IS_ERR(prod[i].task)) {
+			ret = PTR_ERR(prod[i].task);
+			nr_prod = i;
+			goto stop;
+		}
+		kthread_bind(prod[i].task, cpu);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_prod; i++)
+		wake_up_process(prod[i].task);
+	ret = wait_for_completion_interruptible(&b->done);
+	elapsed = ktime_get_ns() - t0;
+
+stop:
+	/** items must be idle before the next run reinitializes them */
+	for (i = 0; i < nr_prod; i++) {
+		kthread_stop(prod[i].task);
+		for (j = 0; j < wqitems; j++)
+			cancel_work_sync(&prod[i].items[j].work);
+	}
+	if (ret)
+		return ret;
+
+	lat_hist_init(h);
+	for_each_possible_cpu(cpu)
+		lat_hist_merge(h, per_cpu_ptr(b->hist, cpu));
+	return div64_u64(h->count * NSEC_PER_SEC, elapsed ? elapsed : 1);
+}
+
+static struct workqueue_struct *jiq_bench_wq(int flavor)
+{
+	switch (flavor) {
+	case JIQ_WQ_SYSTEM:
+		return system_wq;
+	case JIQ_WQ_HIGHPRI:
+		return system_highpri_wq;
+	case JIQ_WQ_UNBOUND:
+		return system_unbound_wq;
+	case JIQ_WQ_CPU_INTENSIVE:
+		return alloc_workqueue("jiq_cpu_intensive", WQ_CPU_INTENSIVE, 0);
+	case JIQ_WQ_ORDERED:
+		return alloc_ordered_workqueue("jiq_ordered", 0);
+	}
+	return NULL;
+}
+
+static int jiq_wqbench_show(struct seq_file *m, void *v)
+{
+	struct jiq_bench *b;
+	struct jiq_producer *prod;
+	struct lat_hist *run, *total;
+	int max_prod = clamp_t(int, wqproducers, 1, num_online_cpus());
+	int flavor, nr_prod, pl, i;
+	long long rate = 0;
+
+	if (wqitems <= 0 || nr_wqpayload <= 0)
+		return -EINVAL;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	prod = kcalloc(max_prod, sizeof(*prod), GFP_KERNEL);
+	run = kmalloc(sizeof(*run), GFP_KERNEL);
+	total = kmalloc(sizeof(*total), GFP_KERNEL);
+	if (!b || !prod || !run || !total)
+		goto nomem;
+
+	b->hist = alloc_percpu(struct lat_hist);
+	if (!b->hist)
+		goto nomem;
+	for (i = 0; i < max_prod; i++) {
+		prod[i].items = kvcalloc(wqitems, sizeof(struct jiq_item),
+					GFP_KERNEL);
+		if (!prod[i].items)
+			goto nomem;
+	}
+	init_completion(&b->done);
+
+	seq_printf(m, "%d items per producer\n", wqitems);
+	for (flavor = 0; flavor < JIQ_NR_WQ; flavor++) {
+		b->wq = jiq_bench_wq(flavor);
+		if (!b->wq) {
+			rate = -ENOMEM;
+			break;
+		}
+		lat_hist_init(total);
+
+		seq_printf(m, "\n%s\n", jiq_wq_names[flavor]);
+		seq_puts(m, "producers payload(ns)    items/s  avg(ns)  p50 <(ns)"
+				"  p99 <(ns)    max(ns)\n");
+		for (nr_prod = 1; nr_prod <= max_prod; nr_prod *= 2) {
+			for (pl = 0; pl < nr_wqpayload; pl++) {
+				b->payload = wqpayload[pl];
+				rate = jiq_bench_run(b, prod, nr_prod, run);
+				if (rate < 0)
+					goto out_wq;
+				seq_printf(m, "%9d %11llu %10lld %8llu %10llu %10llu %10llu\n",
+						nr_prod, b->payload, rate,
+						lat_hist_avg(run), lat_hist_pct(run, 50),
+						lat_hist_pct(run, 99), run->max);
+				lat_hist_merge(total, run);
+			}
+		}
+		seq_printf(m, "%s latency, all runs\n", jiq_wq_names[flavor]);
+		lat_hist_show(m, total);
+out_wq:
+		if (flavor == JIQ_WQ_CPU_INTENSIVE || flavor == JIQ_WQ_ORDERED)
+			destroy_workqueue(b->wq);
+		if (rate < 0)
+			break;
+	}
+
+	for (i = 0; i < max_prod; i++)
+		kvfree(prod[i].items);
+	free_percpu(b->hist);
+	kfree(total);
+	kfree(run);
+	kfree(prod);
+	kfree(b);
+	return rate < 0 ? rate : 0;
+
+nomem:
+	if (prod)
+		for (i = 0; i < max_prod; i++)
+			kvfree(prod[i].items);
+	if (b)
+		free_percpu(b->hist);
+	kfree(total);
+	kfree(run);
+	kfree(prod);
+	kfree(b);
+	return -ENOMEM;
+}
+
+static int jiq_wqbench_open(struct inode *inode, struct file *file)
+{
+	/** size the buffer up front, a seq_file overflow reruns the show */
+	return single_open_size(file, jiq_wqbench_show, NULL, 64 * 1024);
+}
+
+static struct proc_ops jiq_wqbench_fops = {
+	.proc_open		= jiq_wqbench_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * Load test: 1, 2, 4 ... N requester threads, one per online cpu, each
+ * with its own work item like concurrent readers of jiqwq. A requester
+ * queues its item on the system workqueue and waits for it to run,
+ * wqloads times, and records the queue to execution latency.
+ */
+struct jiq_load;
+
+struct jiq_requester {
+	struct work_struct work;
+	struct completion ran;
+	struct task_struct *task;
+	struct jiq_load *load;
+	struct lat_hist hist;
+	u64 t_queue;
+};
+
+struct jiq_load {
+	atomic_t left;
+	struct completion done;
+	bool stop;
+};
+
+static void jiq_requester_work(struct work_struct *work)
+{
+	struct jiq_requester *r = container_of(work, struct jiq_requester, work);
+
+	lat_hist_add(&r->hist, ktime_get_ns() - r->t_queue);
+	complete(&r->ran);
+}
+
+static int jiq_requester_fn(void *arg)
+{
+	struct jiq_requester *r = arg;
+	int i;
+
+	for (i = 0; i < wqloads && !READ_ONCE(r->load->stop); i++) {
+		reinit_completion(&r->ran);
+		r->t_queue = ktime_get_ns();
+		schedule_work(&r->work);
+		wait_for_completion(&r->ran);
+	}
+
+	if (atomic_dec_and_test(&r->load->left))
+		complete(&r->load->done);
+	jiq_wait_stop();
+	return 0;
+}
+
+static int jiq_wqload_run(struct jiq_requester *req, int nr,
+				struct lat_hist *h)
+{
+	struct jiq_load load;
+	int i, cpu, ret = 0;
+
+	atomic_set(&load.left, nr);
+	init_completion(&load.done);
+	load.stop = false;
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < nr; i++) {
+		INIT_WORK(&req[i].work, jiq_requester_work);
+		init_completion(&req[i].ran);
+		lat_hist_init(&req[i].hist);
+		req[i].load = &load;
+		req[i].task = kthread_create(jiq_requester_fn, &req[i],
+						"jiqreq/%d", i);
+		if (IS_ERR(req[i].task)) {
+			ret = PTR_ERR(req[i].task);
+			nr = i;
+			goto stop;
+		}
+		kthread_bind(req[i].task, cpu);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	for (i = 0; i < nr; i++)
+		wake_up_process(req[i].task);
+	ret = wait_for_completion_interruptible(&load.done);
+
+stop:
+	WRITE_ONCE(load.stop, true);
+	for (i = 0; i < nr; i++) {
+		kthread_stop(req[i].task);
+		cancel_work_sync(&req[i].work);
+	}
+	if (ret)
+		return ret;
+
+	lat_hist_init(h);
+	for (i = 0; i < nr; i++)
+		lat_hist_merge(h, &req[i].hist);
+	return 0;
+}
+
+static int jiq_wqload_show(struct seq_file *m, void *v)
+{
+	struct jiq_requester *req;
+	struct lat_hist *h;
+	int n = num_online_cpus();
+	int nr, ret = 0;
+
+	if (wqloads <= 0)
+		return -EINVAL;
+
+	req = kcalloc(n, sizeof(*req), GFP_KERNEL);
+	h = kmalloc(sizeof(*h), GFP_KERNEL);
+	if (!req || !h) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	seq_printf(m, "%d round trips per requester on system_wq\n", wqloads);
+	seq_puts(m, "requesters  avg(ns)  p50 <(ns)  p99 <(ns)    max(ns)\n");
+	for (nr = 1; ; nr = min(nr * 2, n)) {
+		ret = jiq_wqload_run(req, nr, h);
+		if (ret)
+			break;
+		seq_printf(m, "%10d %8llu %10llu %10llu %10llu\n", nr,
+				lat_hist_avg(h), lat_hist_pct(h, 50),
+				lat_hist_pct(h, 99), h->max);
+		if (nr == n)
+			break;
+	}
+
+out:
+	kfree(h);
+	kfree(req);
+	return ret;
+}
+
+static int jiq_wqload_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jiq_wqload_show, NULL);
+}
+
+static struct proc_ops jiq_wqload_fops = {
+	.proc_open		= jiq_wqload_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * Fan-out: a producer thread bound to the first cpu of each node queues
+ * fanitems work items at once, spread by one of the modes below, and
+ * waits for all of them to run. Reports the cost of a queue call, the
+ * completion rate and how many items ran on another node.
+ *
+ * The cpus are a snapshot taken at the start. Hotplug is only held off
+ * while the producer is bound and while it queues; a run whose
+ * producer cpu went down in between is reported as offline.
+ */
+enum jiq_fan_mode {
+	JIQ_FAN_LOCAL = 0,	/** queue_work_on() the producer cpu */
+	JIQ_FAN_NODE_CPUS,	/** queue_work_on() round robin on its node */
+	JIQ_FAN_ALL_CPUS,	/** queue_work_on() round robin on all cpus */
+	JIQ_FAN_WORK_NODE,	/** queue_work_node() on its node, unbound */
+	JIQ_FAN_UNBOUND,	/** queue_work() on system_unbound_wq */
+	JIQ_NR_FAN
+};
+
+static const char * const jiq_fan_names[JIQ_NR_FAN] = {
+	[JIQ_FAN_LOCAL]		= "local",
+	[JIQ_FAN_NODE_CPUS]	= "node_cpus",
+	[JIQ_FAN_ALL_CPUS]	= "all_cpus",
+	[JIQ_FAN_WORK_NODE]	= "work_node",
+	[JIQ_FAN_UNBOUND]	= "unbound",
+};
+
+struct jiq_fanout;
+
+struct jiq_fan_item {
+	struct work_struct work;
+	struct jiq_fanout *f;
+};
+
+struct jiq_fanout {
+	struct jiq_fan_item *items;
+	struct task_struct *task;
+	struct completion done;
+	atomic_t left;
+	atomic_t remote;
+	int mode;
+	int node;
+	int cpu;
+	u64 queue_ns;
+	bool stop;
+	bool gone;
+	struct cpumask cpus;
+};
+
+static void jiq_fan_work(struct work_struct *work)
+{
+	struct jiq_fan_item *it = container_of(work, struct jiq_fan_item, work);
+	struct jiq_fanout *f = it->f;
+
+	if (cpu_to_node(raw_smp_processor_id()) != f->node)
+		atomic_inc(&f->remote);
+	if (atomic_dec_and_test(&f->left))
+		complete(&f->done);
+}
+
+static int jiq_fan_next_cpu(int cpu, const struct cpumask *mask)
+{
+	cpu = cpumask_next_and(cpu, mask, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first_and(mask, cpu_online_mask);
+	return cpu;
+}
+
+static int jiq_fan_producer(void *arg)
+{
+	struct jiq_fanout *f = arg;
+	const struct cpumask *node_mask = cpumask_of_node(f->node);
+	int cpu = f->cpu;
+	u64 t0;
+	int i;
+
+	cpus_read_lock();
+	/** unbound by a hotplug before it ran, nothing to measure */
+	if (raw_smp_processor_id() != f->cpu) {
+		f->gone = true;
+		cpus_read_unlock();
+		complete(&f->done);
+		jiq_wait_stop();
+		return 0;
+	}
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < fanitems && !READ_ONCE(f->stop); i++) {
+		struct work_struct *work = &f->items[i].work;
+
+		switch (f->mode) {
+		case JIQ_FAN_LOCAL:
+			queue_work_on(f->cpu, system_wq, work);
+			break;
+		case JIQ_FAN_NODE_CPUS:
+			cpu = jiq_fan_next_cpu(cpu, node_mask);
+			queue_work_on(cpu, system_wq, work);
+			break;
+		case JIQ_FAN_ALL_CPUS:
+			cpu = jiq_fan_next_cpu(cpu, cpu_online_mask);
+			queue_work_on(cpu, system_wq, work);
+			break;
+		case JIQ_FAN_WORK_NODE:
+			queue_work_node(f->node, system_unbound_wq, work);
+			break;
+		case JIQ_FAN_UNBOUND:
+			queue_work(system_unbound_wq, work);
+			break;
+		}
+	}
+	f->queue_ns = ktime_get_ns() - t0;
+	cpus_read_unlock();
+
+	jiq_wait_stop();
+	return 0;
+}
+
+/**
+ * One run, returns items/s, 0 with f->gone set if the producer cpu went
+ * offline, or a negative error
+ */
+static long long jiq_fan_run(struct jiq_fanout *f)
+{
+	u64 t0 = 0, elapsed;
+	int i, ret;
+
+	for (i = 0; i < fanitems; i++) {
+		INIT_WORK(&f->items[i].work, jiq_fan_work);
+		f->items[i].f = f;
+	}
+	atomic_set(&f->left, fanitems);
+	atomic_set(&f->remote, 0);
+	reinit_completion(&f->done);
+	f->stop = false;
+	f->gone = false;
+
+	f->task = kthread_create(jiq_fan_producer, f, "jiqfan/%d", f->cpu);
+	if (IS_ERR(f->task))
+		return PTR_ERR(f->task);
+
+	cpus_read_lock();
+	if (cpu_online(f->cpu)) {
+		kthread_bind(f->task, f->cpu);
+		t0 = ktime_get_ns();
+		wake_up_process(f->task);
+	} else {
+		f->gone = true;
+	}
+	cpus_read_unlock();
+	if (f->gone) {
+		/** never woken, the thread exits without running */
+		kthread_stop(f->task);
+		return 0;
+	}
+	ret = wait_for_completion_interruptible(&f->done);
+	elapsed = ktime_get_ns() - t0;
+
+	WRITE_ONCE(f->stop, true);
+	kthread_stop(f->task);
+	/** items must be idle before the next run reinitializes them */
+	for (i = 0; i < fanitems; i++)
+		cancel_work_sync(&f->items[i].work);
+	if (ret || f->gone)
+		return ret;
+
+	return div64_u64((u64)fanitems * NSEC_PER_SEC, elapsed ? elapsed : 1);
+}
+
+static int jiq_fanout_show(struct seq_file *m, void *v)
+{
+	struct jiq_fanout *f;
+	long long rate = 0;
+	int node;
+
+	if (fanitems <= 0)
+		return -EINVAL;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	f->items = kvcalloc(fanitems, sizeof(*f->items), GFP_KERNEL);
+	if (!f->items) {
+		kfree(f);
+		return -ENOMEM;
+	}
+	init_completion(&f->done);
+
+	cpus_read_lock();
+	cpumask_copy(&f->cpus, cpu_online_mask);
+	cpus_read_unlock();
+
+	seq_printf(m, "%d items per run, %d cpus, %d nodes\n", fanitems,
+			cpumask_weight(&f->cpus), num_online_nodes());
+
+	for_each_online_node(node) {
+		f->node = node;
+		f->cpu = cpumask_first_and(cpumask_of_node(node), &f->cpus);
+		if (f->cpu >= nr_cpu_ids)
+			continue;
+
+		seq_printf(m, "\nnode %d, producer on cpu %d\n", node, f->cpu);
+		seq_puts(m, "     mode  queue(ns/op)    items/s  remote node(%)\n");
+		for (f->mode = 0; f->mode < JIQ_NR_FAN; f->mode++) {
+			rate = jiq_fan_run(f);
+			if (rate < 0)
+				goto out;
+			if (f->gone) {
+				seq_printf(m, "%9s %13s\n",
+						jiq_fan_names[f->mode], "offline");
+				continue;
+			}
+			seq_printf(m, "%9s %13llu %10lld %15d\n",
+					jiq_fan_names[f->mode],
+					div_u64(f->queue_ns, fanitems), rate,
+					atomic_read(&f->remote) * 100 / fanitems);
+		}
+	}
+out:
+	kvfree(f->items);
+	kfree(f);
+	return rate < 0 ? rate : 0;
+}
+
+static int jiq_fanout_open(struct inode *inode, struct file *file)
+{
+	return single_open_size(file, jiq_fanout_show, NULL,
+				(num_possible_nodes() + 1) * 512);
+}
+
+static struct proc_ops jiq_fanout_fops = {
+	.proc_open		= jiq_fanout_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * Timer slack study: arm slackitems one-shot timers with random
+ * deadlines over slackspan ms and let them expire. Expiries less than
+ * JIQ_SLACK_GAP_NS apart count as one wakeup, so the modes that
+ * coalesce show fewer wakeups per second and a larger deadline error.
+ * A run gives up one second after the window; the timers still pending
+ * then are not counted as expirations.
+ */
+#define JIQ_SLACK_GAP_NS	(20 * NSEC_PER_USEC)
+#define JIQ_SLACK_LEAD_NS	(10 * NSEC_PER_MSEC)
+
+enum jiq_slack_mode {
+	JIQ_SLACK_TIMER = 0,
+	JIQ_SLACK_TIMER_BATCH,
+	JIQ_SLACK_DEFERRABLE,
+	JIQ_SLACK_HRTIMER,
+	JIQ_SLACK_HRTIMER_RANGE,
+	JIQ_SLACK_DWORK,
+	JIQ_SLACK_DWORK_DEFER,
+	JIQ_NR_SLACK
+};
+
+static const char * const jiq_slack_names[JIQ_NR_SLACK] = {
+	[JIQ_SLACK_TIMER]		= "timer",
+	[JIQ_SLACK_TIMER_BATCH]		= "timer_batch",
+	[JIQ_SLACK_DEFERRABLE]		= "deferrable",
+	[JIQ_SLACK_HRTIMER]		= "hrtimer",
+	[JIQ_SLACK_HRTIMER_RANGE]	= "hrtimer_range",
+	[JIQ_SLACK_DWORK]		= "dwork",
+	[JIQ_SLACK_DWORK_DEFER]		= "dwork_defer",
+};
+
+struct jiq_slack;
+
+struct jiq_slack_item {
+	struct timer_list timer;
+	struct hrtimer hrt;
+	struct delayed_work dwork;
+	struct jiq_slack *s;
+	u64 deadline;
+};
+
+struct jiq_slack {
+	struct jiq_slack_item *items;
+	int mode;
+	atomic_t left;
+	struct completion done;
+	spinlock_t lock;	/** protects the fields below */
+	u64 last;
+	u64 end;
+	unsigned long wakeups;
+	unsigned long fired;
+	unsigned long early;
+	struct lat_hist late;
+};
+
+static void jiq_slack_fire(struct jiq_slack_item *it)
+{
+	struct jiq_slack *s = it->s;
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (now > s->last + JIQ_SLACK_GAP_NS)
+		s->wakeups++;
+	if (now > s->last)
+		s->last = now;
+	s->end = s->last;
+	s->fired++;
+	/** jiffies timers may run up to a tick before the ns deadline */
+	if (now < it->deadline)
+		s->early++;
+	else
+		lat_hist_add(&s->late, now - it->deadline);
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	if (atomic_dec_and_test(&s->left))
+		complete(&s->done);
+}
+
+static void jiq_slack_timer_fn(struct timer_list *t)
+{
+	struct jiq_slack_item *it = from_timer(it, t, timer);
+
+	jiq_slack_fire(it);
+}
+
+static enum hrtimer_restart jiq_slack_hrtimer_fn(struct hrtimer *t)
+{
+	jiq_slack_fire(container_of(t, struct jiq_slack_item, hrt));
+	return HRTIMER_NORESTART;
+}
+
+static void jiq_slack_work_fn(struct work_struct *work)
+{
+	jiq_slack_fire(container_of(to_delayed_work(work),
+				struct jiq_slack_item, dwork));
+}
+
+static void jiq_slack_arm(struct jiq_slack *s, struct jiq_slack_item *it)
+{
+	u64 now = ktime_get_ns();
+	u64 slack = (u64)slackus * NSEC_PER_USEC;
+	unsigned long j, batch;
+
+	/** round up, a relative timeout must not be shortened */
+	j = it->deadline > now ?
+		DIV_ROUND_UP_ULL(it->deadline - now, TICK_NSEC) : 0;
+	batch = max_t(unsigned long, usecs_to_jiffies(slackus), 1);
+
+	switch (s->mode) {
+	case JIQ_SLACK_TIMER:
+	case JIQ_SLACK_DEFERRABLE:
+		mod_timer(&it->timer, jiffies + j);
+		break;
+	case JIQ_SLACK_TIMER_BATCH:
+		/** align to the batch so neighbours share one expiry */
+		timer_reduce(&it->timer, roundup(jiffies + j, batch));
+		break;
+	case JIQ_SLACK_HRTIMER:
+		hrtimer_start(&it->hrt, ns_to_ktime(it->deadline),
+				HRTIMER_MODE_ABS);
+		break;
+	case JIQ_SLACK_HRTIMER_RANGE:
+		hrtimer_start_range_ns(&it->hrt, ns_to_ktime(it->deadline),
+				slack, HRTIMER_MODE_ABS);
+		break;
+	case JIQ_SLACK_DWORK:
+	case JIQ_SLACK_DWORK_DEFER:
+		queue_delayed_work(system_wq, &it->dwork, j);
+		break;
+	}
+}
+
+static void jiq_slack_cancel(struct jiq_slack *s, struct jiq_slack_item *it)
+{
+	switch (s->mode) {
+	case JIQ_SLACK_TIMER:
+	case JIQ_SLACK_TIMER_BATCH:
+	case JIQ_SLACK_DEFERRABLE:
+		del_timer_sync(&it->timer);
+		break;
+	case JIQ_SLACK_HRTIMER:
+	case JIQ_SLACK_HRTIMER_RANGE:
+		hrtimer_cancel(&it->hrt);
+		break;
+	case JIQ_SLACK_DWORK:
+	case JIQ_SLACK_DWORK_DEFER:
+		cancel_delayed_work_sync(&it->dwork);
+		break;
+	}
+}
+
+/**
+ * Returns the elapsed ns from arming to the last expiry
+ */
+static long long jiq_slack_run(struct jiq_slack *s)
+{
+	u64 span = (u64)slackspan * NSEC_PER_MSEC;
+	struct jiq_slack_item *it;
+	u64 t0;
+	long left;
+	int i;
+
+	for (i = 0; i < slackitems; i++) {
+		it = &s->items[i];
+		it->s = s;
+		switch (s->mode) {
+		case JIQ_SLACK_TIMER:
+		case JIQ_SLACK_TIMER_BATCH:
+			timer_setup(&it->timer, jiq_slack_timer_fn, 0);
+			break;
+		case JIQ_SLACK_DEFERRABLE:
+			timer_setup(&it->timer, jiq_slack_timer_fn,
+					TIMER_DEFERRABLE);
+			break;
+		case JIQ_SLACK_HRTIMER:
+		case JIQ_SLACK_HRTIMER_RANGE:
+			hrtimer_init(&it->hrt, CLOCK_MONOTONIC,
+					HRTIMER_MODE_ABS);
+			it->hrt.function = jiq_slack_hrtimer_fn;
+			break;
+		case JIQ_SLACK_DWORK:
+			INIT_DELAYED_WORK(&it->dwork, jiq_slack_work_fn);
+			break;
+		case JIQ_SLACK_DWORK_DEFER:
+			INIT_DEFERRABLE_WORK(&it->dwork, jiq_slack_work_fn);
+			break;
+		}
+	}
+	atomic_set(&s->left, slackitems);
+	reinit_completion(&s->done);
+	s->last = 0;
+	s->end = 0;
+	s->wakeups = 0;
+	s->fired = 0;
+	s->early = 0;
+	lat_hist_init(&s->late);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < slackitems; i++) {
+		it = &s->items[i];
+		it->deadline = t0 + JIQ_SLACK_LEAD_NS +
+			mul_u64_u32_shr(span, get_random_u32(), 32);
+		jiq_slack_arm(s, it);
+	}
+
+	left = wait_for_completion_interruptible_timeout(&s->done,
+			nsecs_to_jiffies(JIQ_SLACK_LEAD_NS + span) + HZ);
+
+	/** what did not fire by now is not coming back to s */
+	for (i = 0; i < slackitems; i++)
+		jiq_slack_cancel(s, &s->items[i]);
+
+	if (left < 0)
+		return left;
+	return s->end > t0 ? s->end - t0 : 0;
+}
+
+static int jiq_slack_show(struct seq_file *m, void *v)
+{
+	struct jiq_slack *s;
+	long long elapsed = 0;
+
+	if (slackitems <= 0 || slackspan <= 0 || slackus < 0)
+		return -EINVAL;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+	s->items = kvcalloc(slackitems, sizeof(*s->items), GFP_KERNEL);
+	if (!s->items) {
+		kfree(s);
+		return -ENOMEM;
+	}
+	init_completion(&s->done);
+	spin_lock_init(&s->lock);
+
+	seq_printf(m, "%d timers over %d ms, %d us slack, HZ=%d\n",
+			slackitems, slackspan, slackus, HZ);
+	seq_puts(m, "         mode  expired  wakeups wakeups/s  early"
+			"  avg late(ns)  p99 <(ns)    max(ns)\n");
+	for (s->mode = 0; s->mode < JIQ_NR_SLACK; s->mode++) {
+		elapsed = jiq_slack_run(s);
+		if (elapsed < 0)
+			break;
+		seq_printf(m, "%13s %8lu %8lu %9llu %6lu %13llu %10llu %10llu\n",
+				jiq_slack_names[s->mode], s->fired, s->wakeups,
+				div64_u64((u64)s->wakeups * NSEC_PER_SEC,
+					elapsed ? elapsed : 1),
+				s->early, lat_hist_avg(&s->late),
+				lat_hist_pct(&s->late, 99), s->late.count ?
+				s->late.max : 0);
+	}
+
+	kvfree(s->items);
+	kfree(s);
+	return elapsed < 0 ? elapsed : 0;
+}
+
+static int jiq_slack_open(struct inode *inode, struct file *file)
+{
+	return single_open_size(file, jiq_slack_show, NULL, PAGE_SIZE);
+}
+
+static struct proc_ops jiq_slack_fops = {
+	.proc_open		= jiq_slack_open,
+	.proc_read		= seq_read,
+	.proc_lseek		= seq_lseek,
+	.proc_release	= single_release,
+};
+
+/**
+ * Synthetic cpu contention: echo N > /proc/jiqstress starts N threads
+ * that spin at SCHED_NORMAL, bound to kwcpu or spread over the online
+ * cpus, so the jiq files can be compared under load. echo 0 stops them.
+ */
+static struct task_struct **jiq_hogs;
+static int jiq_nr_hogs;
+static DEFINE_MUTEX(jiq_hogs_lock);
+
+static int jiq_hog_fn(void *arg)
+{
+	while (!kthread_should_stop()) {
+		cpu_relax();
+		cond_resched();
+	}
+	return 0;
+}
+
+static void jiq_hogs_stop(void)
+{
+	int i;
+
+	for (i = 0; i < jiq_nr_hogs; i++)
+		kthread_stop(jiq_hogs[i]);
+	kfree(jiq_hogs);
+	jiq_hogs = NULL;
+	jiq_nr_hogs = 0;
+}
+
+static int jiq_hogs_start(int nr)
+{
+	struct task_struct *t;
+	int i, cpu;
+
+	jiq_hogs = kcalloc(nr, sizeof(*jiq_hogs), GFP_KERNEL);
+	if (!jiq_hogs)
+		return -ENOMEM;
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < nr; i++) {
+		if (kwcpu >= 0)
+			cpu = kwcpu;
+		t = kthread_create(jiq_hog_fn, NULL, "jiqhog/%d", i);
+		if (IS_ERR(t)) {
+			jiq_hogs_stop();
+			return PTR_ERR(t);
+		}
+		kthread_bind(t, cpu);
+		wake_up_process(t);
+		jiq_hogs[jiq_nr_hogs++] = t;
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+	return 0;
+}
+
+static ssize_t jiq_stress_write(struct file *file, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	unsigned int nr;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &nr);
+	if (ret)
+		return ret;
+	if (nr > 4 * num_online_cpus())
+		return -EINVAL;
+
+	mutex_lock(&jiq_hogs_lock);
+	jiq_hogs_stop();
+	ret = nr ? jiq_hogs_start(nr) : 0;
+	mutex_unlock(&jiq_hogs_lock);
+
+	return ret ? ret : count;
+}
+
+static int jiq_stress_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&jiq_hogs_lock);
+	seq_printf(m, "%d\n", jiq_nr_hogs);
+	mutex_unlock(&jiq_hogs_lock);
+	return 0;
+}
+
+static int jiq_stress_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jiq_stress_show, NULL);
+}
+
+static struct proc_ops jiq_stress_fops = {
+	.proc_open		= jiq_stress_open,
+	.proc_read		= seq_read,
+	.proc_write		= jiq_stress_write,
+	.proc_lseek		= seq_lseek,
 	.proc_release	= single_release,
 };
 
@@ -271,16 +1535,24 @@ static struct proc_ops jiq_read_run_timer_fops = {
 
 static int jiq_init(void)
 {
-	/** this line is in jiq_init() */
-	INIT_WORK(&jiq_data.jiq_work, jiq_print_wq);
-	INIT_DELAYED_WORK(&jiq_data.jiq_delayed_work, jiq_print_wq_delayed);
-	tasklet_init(&jiq_data.jiq_tasklet, jiq_print_tasklet,
-		(unsigned long)&jiq_data);
+	int ret;
+
+	ret = jiq_kworker_create();
+	if (ret) {
+		pr_err("could not create jiq kthread worker: %d\n", ret);
+		return ret;
+	}
 
 	proc_create("jiqwq", 0, NULL, &jiq_read_wq_fops);
 	proc_create("jiqwqdelay", 0, NULL, &jiq_read_wq_delayed_fops);
 	proc_create("jitimer", 0, NULL, &jiq_read_run_timer_fops);
 	proc_create("jiqtasklet", 0, NULL, &jiq_read_tasklet_fops);
+	proc_create("jiqwqbench", 0, NULL, &jiq_wqbench_fops);
+	proc_create("jiqwqload", 0, NULL, &jiq_wqload_fops);
+	proc_create("jiqfanout", 0, NULL, &jiq_fanout_fops);
+	proc_create("jiqkthread", 0, NULL, &jiq_read_kthread_fops);
+	proc_create("jiqstress", 0644, NULL, &jiq_stress_fops);
+	proc_create("jiqslack", 0, NULL, &jiq_slack_fops);
 
 	return 0; /** succeed */
 }
@@ -291,6 +1563,15 @@ static void jiq_cleanup(void)
 	remove_proc_entry("jiqwqdelay", NULL);
 	remove_proc_entry("jitimer", NULL);
 	remove_proc_entry("jiqtasklet", NULL);
+	remove_proc_entry("jiqwqbench", NULL);
+	remove_proc_entry("jiqwqload", NULL);
+	remove_proc_entry("jiqfanout", NULL);
+	remove_proc_entry("jiqkthread", NULL);
+	remove_proc_entry("jiqstress", NULL);
+	remove_proc_entry("jiqslack", NULL);
+
+	jiq_hogs_stop();
+	kthread_destroy_worker(jiq_kworker);
 }
 
 
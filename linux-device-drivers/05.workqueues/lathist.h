@@ -0,0 +1,112 @@
+#ifndef _LATHIST_H
+#define _LATHIST_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+
+/**
+ * log2 histogram of latencies in ns, bucket n counts [2^(n-1), 2^n)
+ * and bucket 0 counts the zero samples. The last bucket is open ended,
+ * it counts everything from 2^(LAT_HIST_BUCKETS - 2) ns on, and its
+ * upper bound is the largest sample seen.
+ */
+#define LAT_HIST_BUCKETS	32
+#define LAT_HIST_LAST		(LAT_HIST_BUCKETS - 1)
+
+struct lat_hist {
+	u64 min;
+	u64 max;
+	u64 sum;
+	u64 count;
+	unsigned long bucket[LAT_HIST_BUCKETS];
+};
+
+static inline void lat_hist_init(struct lat_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = U64_MAX;
+}
+
+static inline void lat_hist_add(struct lat_hist *h, u64 ns)
+{
+	int b = fls64(ns);
+
+	if (b > LAT_HIST_LAST)
+		b = LAT_HIST_LAST;
+	h->bucket[b]++;
+	h->count++;
+	h->sum += ns;
+	if (ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+static inline void lat_hist_merge(struct lat_hist *to, struct lat_hist *from)
+{
+	int b;
+
+	for (b = 0; b < LAT_HIST_BUCKETS; b++)
+		to->bucket[b] += from->bucket[b];
+	to->count += from->count;
+	to->sum += from->sum;
+	to->min = min(to->min, from->min);
+	to->max = max(to->max, from->max);
+}
+
+static inline u64 lat_hist_from(int b)
+{
+	return b ? 1ULL << (b - 1) : 0;
+}
+
+/**
+ * Exclusive upper bound of bucket b; for the open ended last bucket
+ * the largest sample seen
+ */
+static inline u64 lat_hist_to(struct lat_hist *h, int b)
+{
+	if (b == LAT_HIST_LAST)
+		return h->max;
+	return b ? 1ULL << b : 1;
+}
+
+/**
+ * Upper bound of the bucket holding the p-th percentile
+ */
+static inline u64 lat_hist_pct(struct lat_hist *h, unsigned int p)
+{
+	u64 want = div_u64(h->count * p + 99, 100);
+	u64 seen = 0;
+	int b;
+
+	for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= want)
+			return b ? lat_hist_to(h, b) : 0;
+	}
+	return h->max;
+}
+
+static inline u64 lat_hist_avg(struct lat_hist *h)
+{
+	return h->count ? div64_u64(h->sum, h->count) : 0;
+}
+
+static inline void lat_hist_show(struct seq_file *m, struct lat_hist *h)
+{
+	int b;
+
+	seq_puts(m, "     from(ns)        to(ns)      count\n");
+	for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+		if (!h->bucket[b])
+			continue;
+		seq_printf(m, "%13llu %13llu %10lu\n", lat_hist_from(b),
+				lat_hist_to(h, b), h->bucket[b]);
+	}
+}
+
+#endif /* _LATHIST_H */
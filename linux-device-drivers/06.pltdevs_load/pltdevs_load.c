@@ -1,13 +1,60 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
 #include "pltdata.h"
 
 #define NR_FIFO_DEVICES	(2)
+#define NR_BENCH_RUNS	(16)
+/**
+ * pltdrv has 4096 minors (NR_MINOR_DEVCS in 07.pltdrv) and the two
+ * static devices hold some, a probe past that fails. Bulk devices
+ * added at load time and by a bench run share what is left, "bound"
+ * in the bench output shows how many probes got a minor.
+ */
+#define PLTDRV_NR_MINORS	(4096)
+#define MAX_BULK_DEVICES	(PLTDRV_NR_MINORS - NR_FIFO_DEVICES)
 
 MODULE_AUTHOR("Arabic Linux Community");
 MODULE_DESCRIPTION("pltdevcs Load");
 MODULE_LICENSE("GPL");
 
+/**
+ * Extra plt-fifo-dev instances registered at load time, on top of the
+ * two static ones. They stay until the module is removed.
+ */
+static unsigned int nr_devices;
+module_param(nr_devices, uint, 0);
+
+/**
+ * One bulk registration: wall time of the register loop, time until
+ * every probe (sync or async) has finished, and the teardown.
+ */
+struct pltdevs_run {
+	unsigned int nr;
+	unsigned int bound;
+	bool async;
+	u64 reg_ns;
+	u64 probe_ns;
+	u64 unreg_ns;
+};
+
+struct pltdevs_bulk {
+	struct platform_device **devs;
+	unsigned int nr;
+	struct pltdevs_run *run;
+};
+
+static struct pltdevs_run bench_runs[NR_BENCH_RUNS];
+static unsigned int nr_bench_runs;
+static DEFINE_MUTEX(bench_lock);
+static struct pltdevs_bulk load_bulk;
+static struct dentry *dbg_dir;
+
 void pltdevs_load_release(struct device*dev)
 {
 	pr_info("pltdevs_load released\n");
@@ -41,8 +88,148 @@ struct platform_device *pltdevices[NR_FIFO_DEVICES] = {
 	&plt_dev1
 };
 
+/**
+ * The probe strategy is the driver's, not ours; load pltdrv with
+ * sync_probe=1 to get the synchronous numbers.
+ */
+static bool pltdevs_driver_async(void)
+{
+	struct device_driver *drv;
+
+	drv = driver_find("plt-fifo-dev", &platform_bus_type);
+	return drv && drv->probe_type == PROBE_PREFER_ASYNCHRONOUS;
+}
+
+static u64 pltdevs_bulk_del(struct pltdevs_bulk *bulk)
+{
+	u64 t0 = ktime_get_ns();
+
+	while (bulk->nr)
+		platform_device_unregister(bulk->devs[--bulk->nr]);
+	kvfree(bulk->devs);
+	bulk->devs = NULL;
+
+	return ktime_get_ns() - t0;
+}
+
+static int pltdevs_bulk_add(struct pltdevs_bulk *bulk, unsigned int nr)
+{
+	struct pltdevs_run *run = bulk->run;
+	struct platform_device *pdev;
+	struct pltdata_fifo data;
+	u64 t0;
+	unsigned int i;
+
+	bulk->devs = kvcalloc(nr, sizeof(*bulk->devs), GFP_KERNEL);
+	if (!bulk->devs)
+		return -ENOMEM;
+	bulk->nr = 0;
+
+	memset(run, 0, sizeof(*run));
+	run->nr = nr;
+	run->async = pltdevs_driver_async();
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr; i++) {
+		data.version = 0xC0 | (i & 0xF);
+		data.fsize = 8 << (i % 4);
+		/** the platform data is copied, data can be reused */
+		pdev = platform_device_register_data(NULL, "plt-fifo-dev",
+				PLATFORM_DEVID_AUTO, &data, sizeof(data));
+		if (IS_ERR(pdev)) {
+			pr_err("bulk device %u failed: %ld\n", i, PTR_ERR(pdev));
+			pltdevs_bulk_del(bulk);
+			return PTR_ERR(pdev);
+		}
+		bulk->devs[bulk->nr++] = pdev;
+	}
+	run->reg_ns = ktime_get_ns() - t0;
+
+	/** async probes still run after the register loop returns */
+	wait_for_device_probe();
+	run->probe_ns = ktime_get_ns() - t0;
+
+	for (i = 0; i < nr; i++)
+		if (READ_ONCE(bulk->devs[i]->dev.driver))
+			run->bound++;
+
+	return 0;
+}
+
+static struct pltdevs_run *pltdevs_next_run(void)
+{
+	return &bench_runs[nr_bench_runs++ % NR_BENCH_RUNS];
+}
+
+/**
+ * echo N > /sys/kernel/debug/pltdevs_load/bench registers N devices,
+ * waits for their probes and removes them again; reading it lists the
+ * last NR_BENCH_RUNS runs, the load time one included.
+ */
+static int pltdevs_bench_show(struct seq_file *m, void *v)
+{
+	struct pltdevs_run *run;
+	unsigned int i, first;
+
+	mutex_lock(&bench_lock);
+	first = nr_bench_runs > NR_BENCH_RUNS ? nr_bench_runs - NR_BENCH_RUNS : 0;
+	seq_puts(m, " devices   bound  probe  register(us)  probed(us)  teardown(us)  probed/dev(us)\n");
+	for (i = first; i < nr_bench_runs; i++) {
+		run = &bench_runs[i % NR_BENCH_RUNS];
+		seq_printf(m, "%8u %7u %6s %13llu %11llu %13llu %15llu\n",
+			run->nr, run->bound, run->async ? "async" : "sync",
+			div_u64(run->reg_ns, NSEC_PER_USEC),
+			div_u64(run->probe_ns, NSEC_PER_USEC),
+			div_u64(run->unreg_ns, NSEC_PER_USEC),
+			div_u64(run->probe_ns, run->nr * NSEC_PER_USEC));
+	}
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+
+static ssize_t pltdevs_bench_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct pltdevs_bulk bulk;
+	unsigned int nr;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &nr);
+	if (ret)
+		return ret;
+	if (!nr || nr > MAX_BULK_DEVICES)
+		return -EINVAL;
+
+	mutex_lock(&bench_lock);
+	bulk.run = pltdevs_next_run();
+	ret = pltdevs_bulk_add(&bulk, nr);
+	if (ret)
+		nr_bench_runs--;
+	else
+		bulk.run->unreg_ns = pltdevs_bulk_del(&bulk);
+	mutex_unlock(&bench_lock);
+
+	return ret ? ret : count;
+}
+
+static int pltdevs_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pltdevs_bench_show, NULL);
+}
+
+static const struct file_operations pltdevs_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = pltdevs_bench_open,
+	.read = seq_read,
+	.write = pltdevs_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
 static int __init pltdevs_load_init(void)
 {
+	int ret;
+
 	/*
 	 * Register one by one.
 	 * platform_device_register(&plt_dev0);
@@ -52,14 +239,48 @@ static int __init pltdevs_load_init(void)
 	/*
 	 * Adding group of devices.
 	 */
-	platform_add_devices(pltdevices, NR_FIFO_DEVICES);
+	ret = platform_add_devices(pltdevices, NR_FIFO_DEVICES);
+	if (ret) {
+		pr_err("failed to add devices: %d\n", ret);
+		return ret;
+	}
+
+	if (nr_devices) {
+		if (nr_devices > MAX_BULK_DEVICES) {
+			ret = -EINVAL;
+			goto err_unregister_static;
+		}
+		load_bulk.run = pltdevs_next_run();
+		ret = pltdevs_bulk_add(&load_bulk, nr_devices);
+		if (ret)
+			goto err_unregister_static;
+		pr_info("%u devices registered in %llu us, probed in %llu us\n",
+			nr_devices, div_u64(load_bulk.run->reg_ns, NSEC_PER_USEC),
+			div_u64(load_bulk.run->probe_ns, NSEC_PER_USEC));
+	}
+
+	dbg_dir = debugfs_create_dir("pltdevs_load", NULL);
+	debugfs_create_file("bench", S_IRUSR | S_IWUSR, dbg_dir, NULL,
+			&pltdevs_bench_fops);
 	pr_info("pltdevs_load initialized\n");
 
 	return 0;
+err_unregister_static:
+	platform_device_unregister(&plt_dev0);
+	platform_device_unregister(&plt_dev1);
+	return ret;
 }
 
 static void __exit pltdevs_load_exit(void)
 {
+	u64 ns;
+
+	debugfs_remove_recursive(dbg_dir);
+	if (load_bulk.devs) {
+		ns = pltdevs_bulk_del(&load_bulk);
+		pr_info("%u devices removed in %llu us\n", nr_devices,
+			div_u64(ns, NSEC_PER_USEC));
+	}
 	platform_device_unregister(&plt_dev0);
 	platform_device_unregister(&plt_dev1);
 	pr_info("pltdevs_load exit\n");
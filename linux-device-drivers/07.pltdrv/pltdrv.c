@@ -5,6 +5,9 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/of_platform.h>
+#include <linux/idr.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
 #include "pltdata.h"
 
 MODULE_AUTHOR("Arabic Linux Community");
@@ -13,10 +16,17 @@ MODULE_LICENSE("GPL");
 
 #define DEFAULT_FIFO_SIZE	(16)
 #define BASE_MINORS			(0)
-#define NR_MINOR_DEVCS		(2)
+#define NR_MINOR_DEVCS		(4096)
 #define DEVICE_NAME			"pltdrv-fifo"
 #define DEVICE_CLASS		"pltdrv-fifoclass"
 
+/**
+ * Force synchronous probing, for comparing against the default
+ * asynchronous one (see 06.pltdevs_load bench).
+ */
+static bool sync_probe;
+module_param(sync_probe, bool, 0);
+
 struct fifo_prvt_devc {
 	struct cdev new_cdevice;
 	struct kfifo myfifo;
@@ -26,13 +36,56 @@ struct fifo_prvt_devc {
 	dev_t devnr;
 };
 
+/**
+ * Probes run asynchronously and in parallel, so minors come from an
+ * IDA and the probe counters are only touched under stats_lock.
+ */
 struct prvt_drv {
 	dev_t b_devnr;
 	struct class *new_class;
+	struct ida minors;
+	spinlock_t stats_lock;
 	int nr_devcs_probed;
+	unsigned long nr_probes;
+	u64 probe_ns_sum;
+	u64 probe_ns_max;
+	u64 first_probe_start;
+	u64 last_probe_end;
 };
 struct prvt_drv prv_drv;
 
+/**
+ * Keep the platform device id as minor when it is free, so boards that
+ * number their fifos get stable names; anything else takes the lowest
+ * free minor.
+ */
+static int pltdrv_get_minor(int id)
+{
+	int minor = -ENOSPC;
+
+	if (id >= 0 && id < NR_MINOR_DEVCS)
+		minor = ida_alloc_range(&prv_drv.minors, id, id, GFP_KERNEL);
+	if (minor < 0)
+		minor = ida_alloc_max(&prv_drv.minors, NR_MINOR_DEVCS - 1,
+					GFP_KERNEL);
+	return minor;
+}
+
+static void pltdrv_probe_account(u64 start, u64 end)
+{
+	spin_lock(&prv_drv.stats_lock);
+	if (!prv_drv.nr_probes || start < prv_drv.first_probe_start)
+		prv_drv.first_probe_start = start;
+	if (end > prv_drv.last_probe_end)
+		prv_drv.last_probe_end = end;
+	prv_drv.nr_probes++;
+	prv_drv.probe_ns_sum += end - start;
+	if (end - start > prv_drv.probe_ns_max)
+		prv_drv.probe_ns_max = end - start;
+	prv_drv.nr_devcs_probed++;
+	spin_unlock(&prv_drv.stats_lock);
+}
+
 static int setup_pltdrv_dev(struct fifo_prvt_devc *dev)
 {
 	int ret;
@@ -131,6 +184,8 @@ static struct file_operations fops = {
 static int pltdrv_probe(struct platform_device *ofdev)
 {
 	int ret;
+	int minor;
+	u64 start = ktime_get_ns(), end;
 	struct device *device = NULL;
 	struct fifo_prvt_devc * dev_data;
 	struct pltdata_fifo * plt_data;
@@ -144,45 +199,58 @@ static int pltdrv_probe(struct platform_device *ofdev)
 						sizeof(struct fifo_prvt_devc), GFP_KERNEL);
 
 	if(!dev_data) {
-		pr_err("Could allocate memory for a device: %d\n", ret);
-		return -EINVAL;
+		pr_err("Could not allocate memory for a device\n");
+		return -ENOMEM;
 	}
 	dev_data->plt_data_prv.version = plt_data->version;
 	dev_data->plt_data_prv.fsize = plt_data->fsize;
 	pr_info("Device version: %d\n", dev_data->plt_data_prv.version);
 	pr_info("Device fsize: %d\n", dev_data->plt_data_prv.fsize);
 
-	dev_data->devnr = prv_drv.b_devnr + ofdev->id;
+	minor = pltdrv_get_minor(ofdev->id);
+	if (minor < 0) {
+		pr_err("No free minor for a device: %d\n", minor);
+		return minor;
+	}
+	dev_data->devnr = MKDEV(MAJOR(prv_drv.b_devnr), minor);
 	pr_info("Device NR: %d\n",  MINOR(dev_data->devnr));
 
 	dev_set_drvdata(&ofdev->dev, dev_data);
 
-	device = device_create(prv_drv.new_class, &ofdev->dev, dev_data->devnr,
-								NULL, "pltdrv-fifo-%d",ofdev->id);
-	if (IS_ERR(device)) {
-		ret = PTR_ERR(device);
-		pr_err("Could not create device: %d\n", ret);
-		return ret;
+	/**
+	 * The fifo must exist before the cdev is live and udev is told
+	 * about the node, an async probe races with the first open.
+	 */
+	ret = setup_pltdrv_dev(dev_data);
+	if (ret) {
+		pr_err("Could not create FIFO\n");
+		goto err_free_minor;
 	}
 	cdev_init(&dev_data->new_cdevice, &fops);
 	dev_data->new_cdevice.owner = THIS_MODULE;
 	ret = cdev_add(&dev_data->new_cdevice,dev_data->devnr, 1);
 	if (ret) {
 		pr_err("Could not register char dev: %d\n", ret);
-		goto err_destruct_device;
+		goto err_setup_pltdrv;
 	}
-	ret = setup_pltdrv_dev(dev_data);
-	if (ret) {
-		pr_err("Could not create FIFO\n");
+	device = device_create(prv_drv.new_class, &ofdev->dev, dev_data->devnr,
+								NULL, "pltdrv-fifo-%d", minor);
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		pr_err("Could not create device: %d\n", ret);
 		goto err_unregister_cdev;
 	}
-	pr_info("Probe ends Successfully: NR of devices %d\n",
-				++prv_drv.nr_devcs_probed);
+	end = ktime_get_ns();
+	pltdrv_probe_account(start, end);
+	dev_info(&ofdev->dev, "Probe ends Successfully in %llu ns\n",
+				end - start);
 	return 0;
 err_unregister_cdev:
 	cdev_del(&dev_data->new_cdevice);
-err_destruct_device:
-	device_destroy(prv_drv.new_class, dev_data->devnr);
+err_setup_pltdrv:
+	uninstall_pltdrv_dev(dev_data);
+err_free_minor:
+	ida_free(&prv_drv.minors, minor);
 	return ret;
 }
 
@@ -190,27 +258,60 @@ static int pltdrv_remove(struct platform_device *ofdev)
 {
 	struct fifo_prvt_devc * dev_data;
 	dev_data = dev_get_drvdata(&ofdev->dev);
-	uninstall_pltdrv_dev(dev_data);
-	cdev_del(&dev_data->new_cdevice);
 	device_destroy(prv_drv.new_class, dev_data->devnr);
+	cdev_del(&dev_data->new_cdevice);
+	uninstall_pltdrv_dev(dev_data);
+	ida_free(&prv_drv.minors, MINOR(dev_data->devnr));
 	pr_info("plt Device removed\n");
-	pr_info("Remove device ends Successfully: NR of devices %d\n",
-				--prv_drv.nr_devcs_probed);
+	spin_lock(&prv_drv.stats_lock);
+	prv_drv.nr_devcs_probed--;
+	spin_unlock(&prv_drv.stats_lock);
 
 	return 0;
 }
 
+/**
+ * /sys/bus/platform/drivers/plt-fifo-dev/probe_stats: probes done,
+ * their summed and longest duration, and the wall time from the first
+ * probe start to the last probe end. A span well below the sum means
+ * the probes overlapped.
+ */
+static ssize_t probe_stats_show(struct device_driver *drv, char *buf)
+{
+	ssize_t len;
+
+	spin_lock(&prv_drv.stats_lock);
+	len = sprintf(buf, "devices %d probes %lu sum_ns %llu max_ns %llu span_ns %llu\n",
+		prv_drv.nr_devcs_probed, prv_drv.nr_probes,
+		prv_drv.probe_ns_sum, prv_drv.probe_ns_max,
+		prv_drv.nr_probes ?
+		prv_drv.last_probe_end - prv_drv.first_probe_start : 0);
+	spin_unlock(&prv_drv.stats_lock);
+	return len;
+}
+static DRIVER_ATTR_RO(probe_stats);
+
+static struct attribute *pltdrv_attrs[] = {
+	&driver_attr_probe_stats.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(pltdrv);
+
 struct platform_driver pltdrv = {
 	.probe = pltdrv_probe,
 	.remove = pltdrv_remove,
 	.driver = {
-		.name = "plt-fifo-dev"
+		.name = "plt-fifo-dev",
+		.groups = pltdrv_groups,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS
 	}
 };
 
 static int __init pltdrv_init(void)
 {
 	int ret;
+	ida_init(&prv_drv.minors);
+	spin_lock_init(&prv_drv.stats_lock);
 	ret = alloc_chrdev_region(&prv_drv.b_devnr, BASE_MINORS, NR_MINOR_DEVCS, DEVICE_NAME);
 	if (ret < 0) {
 		pr_err("failed to allocate device numbers: %d\n", ret);
@@ -224,9 +325,17 @@ static int __init pltdrv_init(void)
 	}
 	pr_info("pltdrv Init\n");
 	
-	platform_driver_register(&pltdrv);
+	if (sync_probe)
+		pltdrv.driver.probe_type = PROBE_FORCE_SYNCHRONOUS;
+	ret = platform_driver_register(&pltdrv);
+	if (ret) {
+		pr_err("failed to register driver: %d\n", ret);
+		goto err_destroy_class;
+	}
 
 	return 0;
+err_destroy_class:
+	class_destroy(prv_drv.new_class);
 err_unregister_chrdev:
 	unregister_chrdev_region(prv_drv.b_devnr, NR_MINOR_DEVCS);
 
@@ -238,6 +347,7 @@ static void __exit pltdrv_exit(void)
 	platform_driver_unregister(&pltdrv);
 	class_destroy(prv_drv.new_class);
 	unregister_chrdev_region(prv_drv.b_devnr, NR_MINOR_DEVCS);
+	ida_destroy(&prv_drv.minors);
 
 	pr_info("pltdrv exit\n");
 }
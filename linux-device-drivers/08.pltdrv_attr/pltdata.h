@@ -1,4 +1,21 @@
 struct pltdata_fifo {
 	int version;
 	int fsize;
-};
\ No newline at end of file
+};
+
+/**
+ * Layout of the fifostats binary sysfs attribute
+ */
+struct pltdata_fifo_stats {
+	__u64 bytes_in;
+	__u64 bytes_out;
+	__u64 writes;
+	__u64 reads;
+	__u64 drops;
+	__u64 rd_blocks;
+	__u64 wr_blocks;
+	__u32 hwm;
+	__u32 fsize;
+	__u32 len;
+	__u32 pad;
+};
@@ -1,11 +1,19 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/kfifo.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/of_platform.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
 #include "pltdata.h"
 
 MODULE_AUTHOR("Arabic Linux Community");
@@ -13,24 +21,84 @@ MODULE_DESCRIPTION("pltdrv_attr ldd");
 MODULE_LICENSE("GPL");
 
 #define DEFAULT_FIFO_SIZE	(16)
+#define MAX_FIFO_SIZE		(1 << 20)
 #define BASE_MINORS			(0)
 #define NR_MINOR_DEVCS		(2)
 #define DEVICE_NAME			"pltdrv-fifo"
 #define DEVICE_CLASS		"pltdrv-fifoclass"
+#define MAX_FIFO_SNAPS		(4)
+
+struct fifo_pcpu_stats {
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long writes;
+	unsigned long reads;
+	unsigned long drops;
+	unsigned long rd_blocks;
+	unsigned long wr_blocks;
+};
+
+/**
+ * A fifodata snapshot belongs to the open file that took it. Bin
+ * attributes have no release hook, so it is freed when its reader
+ * hits EOF, when it is the oldest of more than MAX_FIFO_SNAPS, or
+ * when the device goes away.
+ */
+struct fifo_snap {
+	struct list_head node;
+	struct file *owner;
+	unsigned int len;
+	char data[];
+};
 
+/**
+ * Open files keep a reference, so the fifo outlives remove until the
+ * last close. Remove marks the device gone and wakes both queues; the
+ * cdev is allocated on its own and opens find the device through the
+ * minors idr, as in virtbus_fifo.
+ */
 struct fifo_prvt_devc {
-	struct cdev new_cdevice;
+	struct kref ref;
+	bool gone;
+	struct cdev *new_cdevice;
 	struct kfifo myfifo;
 	struct mutex r_f_lock;
 	struct mutex w_f_lock;
 	struct pltdata_fifo plt_data_prv;
 	dev_t devnr;
+	/**
+	 * Readers sleep on rd_wq until there is data, writers on wr_wq
+	 * until there is room. The counters are updated under the
+	 * matching r_f_lock / w_f_lock.
+	 */
+	wait_queue_head_t rd_wq;
+	wait_queue_head_t wr_wq;
+	/**
+	 * Hot path counters are per cpu and summed on read; the high
+	 * water mark is only moved by writers, under w_f_lock.
+	 */
+	struct fifo_pcpu_stats __percpu *stats;
+	unsigned int hwm;
+	/**
+	 * A resize replaces myfifo under both mutexes and swap_lock. The
+	 * checks that run without the mutexes (wait conditions, poll,
+	 * stats) take swap_lock so they never see a half-copied struct.
+	 */
+	spinlock_t swap_lock;
+	/**
+	 * fifodata snapshots of the open readers, newest first
+	 */
+	struct mutex snap_lock;
+	struct list_head snaps;
+	unsigned int nr_snaps;
 };
 
 struct prvt_drv {
 	dev_t b_devnr;
 	struct class *new_class;
 	int nr_devcs_probed;
+	struct idr minors;	/** minor -> fifo_prvt_devc, under lock */
+	struct mutex lock;
 };
 struct prvt_drv prv_drv;
 
@@ -40,20 +108,102 @@ static int setup_pltdrv_dev(struct fifo_prvt_devc *dev)
 	int fsize = dev->plt_data_prv.fsize;
 	mutex_init(&dev->r_f_lock);
 	mutex_init(&dev->w_f_lock);
+	init_waitqueue_head(&dev->rd_wq);
+	init_waitqueue_head(&dev->wr_wq);
+	mutex_init(&dev->snap_lock);
+	spin_lock_init(&dev->swap_lock);
+	INIT_LIST_HEAD(&dev->snaps);
+	dev->stats = alloc_percpu(struct fifo_pcpu_stats);
+	if (!dev->stats)
+		return -ENOMEM;
 	ret = kfifo_alloc(&dev->myfifo,
 				fsize, GFP_KERNEL);
+	if (ret)
+		free_percpu(dev->stats);
 	return ret;
 }
 
+static void pltdrv_free_snap(struct fifo_prvt_devc *dev, struct fifo_snap *snap)
+{
+	list_del(&snap->node);
+	dev->nr_snaps--;
+	kvfree(snap);
+}
+
 static void uninstall_pltdrv_dev(struct fifo_prvt_devc *dev)
 {
+	struct fifo_snap *snap, *tmp;
+
+	list_for_each_entry_safe(snap, tmp, &dev->snaps, node)
+		pltdrv_free_snap(dev, snap);
+	free_percpu(dev->stats);
 	kfifo_free(&dev->myfifo);
 }
 
+static void pltdrv_dev_free(struct kref *ref)
+{
+	struct fifo_prvt_devc *dev = container_of(ref, struct fifo_prvt_devc, ref);
+
+	uninstall_pltdrv_dev(dev);
+	kfree(dev);
+}
+
+static bool pltdrv_fifo_empty(struct fifo_prvt_devc *dev)
+{
+	bool empty;
+
+	spin_lock(&dev->swap_lock);
+	empty = kfifo_is_empty(&dev->myfifo);
+	spin_unlock(&dev->swap_lock);
+	return empty;
+}
+
+static bool pltdrv_fifo_full(struct fifo_prvt_devc *dev)
+{
+	bool full;
+
+	spin_lock(&dev->swap_lock);
+	full = kfifo_is_full(&dev->myfifo);
+	spin_unlock(&dev->swap_lock);
+	return full;
+}
+
+static void pltdrv_sum_stats(struct fifo_prvt_devc *dev,
+				struct pltdata_fifo_stats *st)
+{
+	struct fifo_pcpu_stats *pcs;
+	int cpu;
+
+	memset(st, 0, sizeof(*st));
+	for_each_possible_cpu(cpu) {
+		pcs = per_cpu_ptr(dev->stats, cpu);
+		st->bytes_in += READ_ONCE(pcs->bytes_in);
+		st->bytes_out += READ_ONCE(pcs->bytes_out);
+		st->writes += READ_ONCE(pcs->writes);
+		st->reads += READ_ONCE(pcs->reads);
+		st->drops += READ_ONCE(pcs->drops);
+		st->rd_blocks += READ_ONCE(pcs->rd_blocks);
+		st->wr_blocks += READ_ONCE(pcs->wr_blocks);
+	}
+	st->hwm = READ_ONCE(dev->hwm);
+	st->fsize = READ_ONCE(dev->plt_data_prv.fsize);
+	spin_lock(&dev->swap_lock);
+	st->len = kfifo_len(&dev->myfifo);
+	spin_unlock(&dev->swap_lock);
+}
+
 static int pltdrv_open_fifo(struct inode *inode, struct file *filp)
 {
 	struct fifo_prvt_devc *dev;
-	dev = container_of(inode->i_cdev, struct fifo_prvt_devc, new_cdevice);
+
+	mutex_lock(&prv_drv.lock);
+	dev = idr_find(&prv_drv.minors, iminor(inode));
+	if (dev)
+		kref_get(&dev->ref);
+	mutex_unlock(&prv_drv.lock);
+	if (!dev)
+		return -ENODEV;
+
 	filp->private_data = dev;
 	pr_info("Open FIFO driver\n");
 	return 0;
@@ -61,41 +211,74 @@ static int pltdrv_open_fifo(struct inode *inode, struct file *filp)
 
 static int pltdrv_release_fifo(struct inode *inode, struct file *filp)
 {
+	struct fifo_prvt_devc *dev = filp->private_data;
+
+	kref_put(&dev->ref, pltdrv_dev_free);
 	pr_info("Close FIFO driver\n");
 	return 0;
 }
 
+/**
+ * Writes block while the fifo is full, or fail with -EAGAIN for
+ * O_NONBLOCK (the refused bytes are counted as drops). Otherwise as
+ * much as fits is queued and that count is returned, so the caller
+ * sees a short write instead of losing the rest.
+ */
 static ssize_t pltdrv_write_fifo(struct file *file, const char __user *buf,
 						size_t count, loff_t *ppos)
 {
 	int ret;
 	unsigned int copiedin;
-	int avail;
 	struct fifo_prvt_devc *dev = (struct fifo_prvt_devc *)file->private_data;
 
+	if (!count)
+		return 0;
+
 	if (mutex_lock_interruptible(&dev->w_f_lock))
 		return -ERESTARTSYS;
 
-	avail = kfifo_avail(&dev->myfifo);
-	pr_info("kfifo available bytes %d\n", avail);
+	while (kfifo_is_full(&dev->myfifo)) {
+		if (READ_ONCE(dev->gone)) {
+			mutex_unlock(&dev->w_f_lock);
+			return -ENODEV;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			this_cpu_add(dev->stats->drops, count);
+			mutex_unlock(&dev->w_f_lock);
+			return -EAGAIN;
+		}
+		this_cpu_inc(dev->stats->wr_blocks);
+		mutex_unlock(&dev->w_f_lock);
+		if (wait_event_interruptible(dev->wr_wq,
+					!pltdrv_fifo_full(dev) || READ_ONCE(dev->gone)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->w_f_lock))
+			return -ERESTARTSYS;
+	}
 
 	ret = kfifo_from_user(&dev->myfifo, buf, count, &copiedin);
+	if (kfifo_len(&dev->myfifo) > dev->hwm)
+		WRITE_ONCE(dev->hwm, kfifo_len(&dev->myfifo));
 	mutex_unlock(&dev->w_f_lock);
-	pr_info("The data copied: %d\n", copiedin);
-	
+
+	this_cpu_inc(dev->stats->writes);
+	this_cpu_add(dev->stats->bytes_in, copiedin);
+
+	if (copiedin)
+		wake_up_interruptible(&dev->rd_wq);
 	/**
 	 * in case of -EFAULT -> ret to system 
 	 */
 	if (ret)
 		return ret;
-	/** 
-	 * I don't need kernel code to invoke write again
-	 * with the rest of uncopied data that's failed
-	 * because of fifo size limitation -> ret count.
-	 */
-	return count;
+
+	return copiedin;
 }
 
+/**
+ * Reads block while the fifo is empty, or fail with -EAGAIN for
+ * O_NONBLOCK.
+ */
 static ssize_t pltdrv_read_fifo(struct file *file, char __user *buf,
 						size_t count, loff_t *ppos)
 {
@@ -103,12 +286,38 @@ static ssize_t pltdrv_read_fifo(struct file *file, char __user *buf,
 	unsigned int copiedout;
 	struct fifo_prvt_devc *dev = (struct fifo_prvt_devc *)file->private_data;
 
+	if (!count)
+		return 0;
+
 	if (mutex_lock_interruptible(&dev->r_f_lock))
 		return -ERESTARTSYS;
 
+	while (kfifo_is_empty(&dev->myfifo)) {
+		if (READ_ONCE(dev->gone)) {
+			mutex_unlock(&dev->r_f_lock);
+			return -ENODEV;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			mutex_unlock(&dev->r_f_lock);
+			return -EAGAIN;
+		}
+		this_cpu_inc(dev->stats->rd_blocks);
+		mutex_unlock(&dev->r_f_lock);
+		if (wait_event_interruptible(dev->rd_wq,
+					!pltdrv_fifo_empty(dev) || READ_ONCE(dev->gone)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->r_f_lock))
+			return -ERESTARTSYS;
+	}
+
 	ret = kfifo_to_user(&dev->myfifo, buf, count, &copiedout);
 	mutex_unlock(&dev->r_f_lock);
 
+	this_cpu_inc(dev->stats->reads);
+	this_cpu_add(dev->stats->bytes_out, copiedout);
+
+	if (copiedout)
+		wake_up_interruptible(&dev->wr_wq);
 	/**
 	 * in case of -EFAULT -> ret to system 
 	 */
@@ -118,12 +327,29 @@ static ssize_t pltdrv_read_fifo(struct file *file, char __user *buf,
 	return copiedout;
 }
 
+static __poll_t pltdrv_poll_fifo(struct file *file, poll_table *wait)
+{
+	struct fifo_prvt_devc *dev = (struct fifo_prvt_devc *)file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &dev->rd_wq, wait);
+	poll_wait(file, &dev->wr_wq, wait);
+	if (READ_ONCE(dev->gone))
+		return EPOLLERR | EPOLLHUP;
+	if (!pltdrv_fifo_empty(dev))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (!pltdrv_fifo_full(dev))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = pltdrv_open_fifo,
 	.release = pltdrv_release_fifo,
 	.read = pltdrv_read_fifo,
-	.write = pltdrv_write_fifo
+	.write = pltdrv_write_fifo,
+	.poll = pltdrv_poll_fifo
 };
 
 static ssize_t show_fsize(struct device *dev, struct device_attribute *attr, 
@@ -158,17 +384,220 @@ static ssize_t store_fversion(struct device *dev, struct device_attribute *attr,
 	return count;
 }
 
-static DEVICE_ATTR(fifosize, S_IRUGO, show_fsize, NULL);
+static ssize_t show_fblocks(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	struct fifo_prvt_devc * dev_data;
+	struct pltdata_fifo_stats st;
+	dev_data = (struct fifo_prvt_devc *)dev_get_drvdata(dev);
+	pltdrv_sum_stats(dev_data, &st);
+	return sprintf(buf, "sysfs show : device fifo blocked reads %llu writes %llu\n",
+		st.rd_blocks, st.wr_blocks);
+}
+
+static ssize_t show_fdrops(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	struct fifo_prvt_devc * dev_data;
+	struct pltdata_fifo_stats st;
+	dev_data = (struct fifo_prvt_devc *)dev_get_drvdata(dev);
+	pltdrv_sum_stats(dev_data, &st);
+	return sprintf(buf, "sysfs show : device fifo dropped bytes %llu\n",
+		st.drops);
+}
+
+/**
+ * Resize the fifo in place: the queued bytes move to a new kfifo while
+ * both the read and the write lock are held, so no reader or writer
+ * sees the switch. Shrinking below what is queued fails with -EBUSY.
+ * kfifo rounds the size up to a power of two.
+ */
+static ssize_t store_fsize(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct fifo_prvt_devc * dev_data;
+	struct kfifo newfifo, oldfifo;
+	unsigned int fsize, len;
+	void *bounce = NULL;
+	int ret;
+
+	dev_data = (struct fifo_prvt_devc *)dev_get_drvdata(dev);
+	ret = kstrtouint(buf, 10, &fsize);
+	if (ret)
+		return ret;
+	if (fsize < 2 || fsize > MAX_FIFO_SIZE)
+		return -EINVAL;
+
+	ret = kfifo_alloc(&newfifo, fsize, GFP_KERNEL);
+	if (ret)
+		return ret;
+	/** the queued bytes pass through here, at most the new size */
+	bounce = kvmalloc(kfifo_size(&newfifo), GFP_KERNEL);
+	if (!bounce) {
+		kfifo_free(&newfifo);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&dev_data->r_f_lock);
+	mutex_lock(&dev_data->w_f_lock);
+
+	len = kfifo_len(&dev_data->myfifo);
+	if (len > kfifo_size(&newfifo)) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	if (len) {
+		len = kfifo_out(&dev_data->myfifo, bounce, len);
+		kfifo_in(&newfifo, bounce, len);
+	}
+	spin_lock(&dev_data->swap_lock);
+	oldfifo = dev_data->myfifo;
+	dev_data->myfifo = newfifo;
+	spin_unlock(&dev_data->swap_lock);
+	newfifo = oldfifo;
+	dev_data->plt_data_prv.fsize = kfifo_size(&dev_data->myfifo);
+
+out_unlock:
+	mutex_unlock(&dev_data->w_f_lock);
+	mutex_unlock(&dev_data->r_f_lock);
+	kvfree(bounce);
+	/** the old fifo on success, the unused new one on failure */
+	kfifo_free(&newfifo);
+	if (ret)
+		return ret;
+
+	/** room or data may have appeared for sleepers */
+	wake_up_interruptible(&dev_data->wr_wq);
+	wake_up_interruptible(&dev_data->rd_wq);
+	return count;
+}
+
+static DEVICE_ATTR(fifosize, S_IRUGO|S_IWUSR, show_fsize, store_fsize);
 static DEVICE_ATTR(fifoversion, S_IRUGO|S_IWUSR, show_fversion, store_fversion);
+static DEVICE_ATTR(fifoblocks, S_IRUGO, show_fblocks, NULL);
+static DEVICE_ATTR(fifodrops, S_IRUGO, show_fdrops, NULL);
 
 static struct attribute * fifo_attrs[] = {
 	&dev_attr_fifosize.attr,
 	&dev_attr_fifoversion.attr,
+	&dev_attr_fifoblocks.attr,
+	&dev_attr_fifodrops.attr,
+	NULL
+};
+
+/**
+ * fifodata: the queued bytes, oldest first, without consuming them.
+ * A read at offset 0 copies the whole fifo with both locks held into
+ * a snapshot owned by that open file, later offsets are served from
+ * it, so every reader that starts at 0 and reads to EOF gets its own
+ * consistent snapshot. A reader whose snapshot was dropped gets
+ * -ESTALE and has to start over.
+ */
+static ssize_t fifodata_read(struct file *filp, struct kobject *kobj,
+			struct bin_attribute *attr, char *buf,
+			loff_t off, size_t count)
+{
+	struct fifo_prvt_devc * dev_data;
+	struct fifo_snap *snap, *tmp;
+	unsigned int len, size;
+	ssize_t ret = 0;
+
+	dev_data = (struct fifo_prvt_devc *)dev_get_drvdata(kobj_to_dev(kobj));
+
+	mutex_lock(&dev_data->snap_lock);
+	list_for_each_entry_safe(snap, tmp, &dev_data->snaps, node) {
+		if (snap->owner != filp)
+			continue;
+		if (!off) {
+			/** the same file starts over */
+			pltdrv_free_snap(dev_data, snap);
+			break;
+		}
+		if (off < snap->len) {
+			ret = min_t(size_t, count, snap->len - off);
+			memcpy(buf, snap->data + off, ret);
+		} else {
+			pltdrv_free_snap(dev_data, snap);
+		}
+		goto out;
+	}
+	if (off) {
+		ret = -ESTALE;
+		goto out;
+	}
+
+	spin_lock(&dev_data->swap_lock);
+	size = kfifo_size(&dev_data->myfifo);
+	spin_unlock(&dev_data->swap_lock);
+	snap = kvmalloc(struct_size(snap, data, size), GFP_KERNEL);
+	if (!snap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	mutex_lock(&dev_data->r_f_lock);
+	mutex_lock(&dev_data->w_f_lock);
+	/** a resize may have raced with the allocation above */
+	len = min(kfifo_len(&dev_data->myfifo), size);
+	snap->len = kfifo_out_peek(&dev_data->myfifo, snap->data, len);
+	mutex_unlock(&dev_data->w_f_lock);
+	mutex_unlock(&dev_data->r_f_lock);
+
+	if (!snap->len) {
+		kvfree(snap);
+		goto out;
+	}
+	snap->owner = filp;
+	list_add(&snap->node, &dev_data->snaps);
+	if (++dev_data->nr_snaps > MAX_FIFO_SNAPS)
+		pltdrv_free_snap(dev_data, list_last_entry(&dev_data->snaps,
+					struct fifo_snap, node));
+	ret = min_t(size_t, count, snap->len);
+	memcpy(buf, snap->data, ret);
+out:
+	mutex_unlock(&dev_data->snap_lock);
+	return ret;
+}
+
+/**
+ * fifostats: struct pltdata_fifo_stats, one read, no parsing
+ */
+static ssize_t fifostats_read(struct file *filp, struct kobject *kobj,
+			struct bin_attribute *attr, char *buf,
+			loff_t off, size_t count)
+{
+	struct fifo_prvt_devc * dev_data;
+	struct pltdata_fifo_stats st;
+
+	dev_data = (struct fifo_prvt_devc *)dev_get_drvdata(kobj_to_dev(kobj));
+	if (off >= sizeof(st))
+		return 0;
+	pltdrv_sum_stats(dev_data, &st);
+	count = min_t(size_t, count, sizeof(st) - off);
+	memcpy(buf, (char *)&st + off, count);
+	return count;
+}
+
+static BIN_ATTR_RO(fifodata, 0);
+static BIN_ATTR_RO(fifostats, sizeof(struct pltdata_fifo_stats));
+
+static struct bin_attribute * fifo_bin_attrs[] = {
+	&bin_attr_fifodata,
+	&bin_attr_fifostats,
 	NULL
 };
 
 static struct attribute_group fifo_attr_grp = {
-	.attrs = fifo_attrs
+	.attrs = fifo_attrs,
+	.bin_attrs = fifo_bin_attrs
+};
+
+/**
+ * Created by the driver core once probe succeeded and removed before
+ * pltdrv_remove runs, so fifosize can never resize a freed fifo.
+ */
+static const struct attribute_group * fifo_attr_grps[] = {
+	&fifo_attr_grp,
+	NULL
 };
 
 /**
@@ -186,13 +615,13 @@ static int pltdrv_probe(struct platform_device *ofdev)
 		pr_err("No platfrom data for a device\n");
 		return -ENOMEM;
 	}
-	dev_data = (struct fifo_prvt_devc *)devm_kzalloc(&ofdev->dev,
-						sizeof(struct fifo_prvt_devc), GFP_KERNEL);
+	dev_data = kzalloc(sizeof(struct fifo_prvt_devc), GFP_KERNEL);
 
 	if(!dev_data) {
-		pr_err("Could allocate memory for a device: %d\n", ret);
-		return -EINVAL;
+		pr_err("Could not allocate memory for a device\n");
+		return -ENOMEM;
 	}
+	kref_init(&dev_data->ref);
 	dev_data->plt_data_prv.version = plt_data->version;
 	dev_data->plt_data_prv.fsize = plt_data->fsize;
 	pr_info("Device version: %d\n", dev_data->plt_data_prv.version);
@@ -203,39 +632,55 @@ static int pltdrv_probe(struct platform_device *ofdev)
 
 	dev_set_drvdata(&ofdev->dev, dev_data);
 
-	device = device_create(prv_drv.new_class, &ofdev->dev, dev_data->devnr,
-								NULL, "pltdrv-fifo-%d",ofdev->id);
-	if (IS_ERR(device)) {
-		ret = PTR_ERR(device);
-		pr_err("Could not create device: %d\n", ret);
+	/**
+	 * The fifo must exist before the cdev and the node are live, and
+	 * remove tears them down in reverse.
+	 */
+	ret = setup_pltdrv_dev(dev_data);
+	if (ret) {
+		pr_err("Could not create FIFO\n");
+		kfree(dev_data);
 		return ret;
 	}
-	cdev_init(&dev_data->new_cdevice, &fops);
-	dev_data->new_cdevice.owner = THIS_MODULE;
-	ret = cdev_add(&dev_data->new_cdevice,dev_data->devnr, 1);
-	if (ret) {
-		pr_err("Could not register char dev: %d\n", ret);
-		goto err_destruct_device;
+	mutex_lock(&prv_drv.lock);
+	ret = idr_alloc(&prv_drv.minors, dev_data, MINOR(dev_data->devnr),
+				MINOR(dev_data->devnr) + 1, GFP_KERNEL);
+	mutex_unlock(&prv_drv.lock);
+	if (ret < 0) {
+		pr_err("Minor %d is taken: %d\n", MINOR(dev_data->devnr), ret);
+		goto err_put;
 	}
-	ret = setup_pltdrv_dev(dev_data);
+	dev_data->new_cdevice = cdev_alloc();
+	if (!dev_data->new_cdevice) {
+		ret = -ENOMEM;
+		goto err_free_minor;
+	}
+	dev_data->new_cdevice->ops = &fops;
+	dev_data->new_cdevice->owner = THIS_MODULE;
+	ret = cdev_add(dev_data->new_cdevice,dev_data->devnr, 1);
 	if (ret) {
-		pr_err("Could not create FIFO\n");
+		pr_err("Could not register char dev: %d\n", ret);
 		goto err_unregister_cdev;
 	}
-	ret = sysfs_create_group(&ofdev->dev.kobj, &fifo_attr_grp);
-	if (ret) {
-		pr_err("Could not create sysfs group\n");
-		goto err_setup_pltdrv;
+	device = device_create(prv_drv.new_class, &ofdev->dev, dev_data->devnr,
+								NULL, "pltdrv-fifo-%d",ofdev->id);
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		pr_err("Could not create device: %d\n", ret);
+		goto err_unregister_cdev;
 	}
 	pr_info("Probe ends Successfully: NR of devices %d\n",
 				++prv_drv.nr_devcs_probed);
 	return 0;
-err_setup_pltdrv:
-	uninstall_pltdrv_dev(dev_data);
 err_unregister_cdev:
-	cdev_del(&dev_data->new_cdevice);
-err_destruct_device:
-	device_destroy(prv_drv.new_class, dev_data->devnr);
+	/** drops the cdev_alloc() reference as well */
+	cdev_del(dev_data->new_cdevice);
+err_free_minor:
+	mutex_lock(&prv_drv.lock);
+	idr_remove(&prv_drv.minors, MINOR(dev_data->devnr));
+	mutex_unlock(&prv_drv.lock);
+err_put:
+	kref_put(&dev_data->ref, pltdrv_dev_free);
 	return ret;
 }
 
@@ -243,10 +688,18 @@ static int pltdrv_remove(struct platform_device *ofdev)
 {
 	struct fifo_prvt_devc * dev_data;
 	dev_data = dev_get_drvdata(&ofdev->dev);
-	uninstall_pltdrv_dev(dev_data);
-	cdev_del(&dev_data->new_cdevice);
 	device_destroy(prv_drv.new_class, dev_data->devnr);
-	sysfs_remove_group(&ofdev->dev.kobj, &fifo_attr_grp);
+	/** no new opens find it after this */
+	mutex_lock(&prv_drv.lock);
+	idr_remove(&prv_drv.minors, MINOR(dev_data->devnr));
+	mutex_unlock(&prv_drv.lock);
+	cdev_del(dev_data->new_cdevice);
+
+	WRITE_ONCE(dev_data->gone, true);
+	wake_up_interruptible(&dev_data->rd_wq);
+	wake_up_interruptible(&dev_data->wr_wq);
+	/** the fifo goes with the last open file */
+	kref_put(&dev_data->ref, pltdrv_dev_free);
 	pr_info("plt Device removed\n");
 	pr_info("Remove device ends Successfully: NR of devices %d\n",
 				--prv_drv.nr_devcs_probed);
@@ -258,13 +711,16 @@ struct platform_driver pltdrv = {
 	.probe = pltdrv_probe,
 	.remove = pltdrv_remove,
 	.driver = {
-		.name = "plt-fifo-dev"
+		.name = "plt-fifo-dev",
+		.dev_groups = fifo_attr_grps
 	}
 };
 
 static int __init pltdrv_init(void)
 {
 	int ret;
+	idr_init(&prv_drv.minors);
+	mutex_init(&prv_drv.lock);
 	ret = alloc_chrdev_region(&prv_drv.b_devnr, BASE_MINORS, NR_MINOR_DEVCS, DEVICE_NAME);
 	if (ret < 0) {
 		pr_err("failed to allocate device numbers: %d\n", ret);
@@ -292,6 +748,7 @@ static void __exit pltdrv_exit(void)
 	platform_driver_unregister(&pltdrv);
 	class_destroy(prv_drv.new_class);
 	unregister_chrdev_region(prv_drv.b_devnr, NR_MINOR_DEVCS);
+	idr_destroy(&prv_drv.minors);
 	pr_info("pltdrv_attr exit\n");
 }
 
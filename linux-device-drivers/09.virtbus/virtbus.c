@@ -2,12 +2,58 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/string.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rculist.h>
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/async.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "virtbus.h"
 
 MODULE_AUTHOR("Arabic Linux Community");
 MODULE_DESCRIPTION("virtbus ldd");
 MODULE_LICENSE("GPL");
 
+/**
+ * Default probe type of drivers that do not pick one themselves
+ * through driver.probe_type.
+ */
+static bool async_probe;
+module_param(async_probe, bool, 0444);
+
+/**
+ * Probe and batch registration timings, /sys/kernel/debug/virtbus/stats
+ */
+struct virtbus_stats {
+	u64 probes;
+	u64 probe_fails;
+	u64 probe_ns;
+	u64 probe_max_ns;
+	int probe_max_inflight;
+	u64 batches;
+	unsigned int batch_nr;
+	unsigned int batch_chunks;
+	u64 batch_add_ns;
+	u64 batch_settle_ns;
+};
+
+static struct virtbus_stats virtbus_stats;
+static DEFINE_SPINLOCK(virtbus_stats_lock);
+static atomic_t virtbus_probing = ATOMIC_INIT(0);
+/** woken when a probe finished, for batches waiting on their devices */
+static DECLARE_WAIT_QUEUE_HEAD(virtbus_probe_wq);
+static struct dentry *virtbus_dbg_dir;
+
 static int virtbus_uevent(struct device *dev, struct kobj_uevent_env *env)
 {
 	if (add_uevent_var(env, "virtbus udev event"))
@@ -15,9 +61,110 @@ static int virtbus_uevent(struct device *dev, struct kobj_uevent_env *env)
 	return 0;
 }
 
+/**
+ * Every id a registered driver accepts, hashed by compatible string.
+ * The driver core calls match for each device x driver pair, so match
+ * only looks at the bucket of the device's precomputed hash instead
+ * of comparing names. Readers use RCU, updates take virtbus_ids_lock.
+ */
+#define VIRTBUS_ID_HASH_BITS	10
+
+struct virtbus_id_node {
+	struct hlist_node node;
+	u32 hash;
+	const char *compatible;
+	const struct virtbus_device_id *id;
+	struct virtbus_drvr *drvr;
+	struct rcu_head rcu;
+};
+
+static DEFINE_HASHTABLE(virtbus_ids, VIRTBUS_ID_HASH_BITS);
+static DEFINE_MUTEX(virtbus_ids_lock);
+
+static u32 virtbus_hash(const char *compatible)
+{
+	return full_name_hash(NULL, compatible, strlen(compatible));
+}
+
+static bool virtbus_lookup_id(struct virtbus_dev *virtbusdev,
+			struct virtbus_drvr *virtbusdrvr,
+			const struct virtbus_device_id **id)
+{
+	struct virtbus_id_node *n;
+	bool found = false;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(virtbus_ids, n, node, virtbusdev->compat_hash) {
+		if (n->drvr != virtbusdrvr || n->hash != virtbusdev->compat_hash ||
+		    strcmp(n->compatible, virtbusdev->compatible))
+			continue;
+		*id = n->id;
+		found = true;
+		break;
+	}
+	rcu_read_unlock();
+	return found;
+}
+
+/**
+ * Called for every driver, without the device lock and from async
+ * probes too, so it must not touch the device; probe sets id_entry.
+ */
 static int virtbus_match(struct device *dev, struct device_driver *driver)
 {
-	return !strncmp(dev_name(dev), driver->name, strlen(driver->name));
+	const struct virtbus_device_id *id;
+
+	return virtbus_lookup_id(to_virtbus_dev(dev), to_virtbus_drvr(driver),
+				&id);
+}
+
+static int virtbus_add_id(struct virtbus_drvr *virtbusdrvr,
+			const struct virtbus_device_id *id, const char *compatible)
+{
+	struct virtbus_id_node *n;
+
+	n = kzalloc(sizeof(*n), GFP_KERNEL);
+	if (!n)
+		return -ENOMEM;
+	n->compatible = compatible;
+	n->hash = virtbus_hash(compatible);
+	n->id = id;
+	n->drvr = virtbusdrvr;
+	hash_add_rcu(virtbus_ids, &n->node, n->hash);
+	return 0;
+}
+
+static void virtbus_del_ids(struct virtbus_drvr *virtbusdrvr)
+{
+	struct virtbus_id_node *n;
+	struct hlist_node *tmp;
+	int bkt;
+
+	mutex_lock(&virtbus_ids_lock);
+	hash_for_each_safe(virtbus_ids, bkt, tmp, n, node) {
+		if (n->drvr != virtbusdrvr)
+			continue;
+		hash_del_rcu(&n->node);
+		kfree_rcu(n, rcu);
+	}
+	mutex_unlock(&virtbus_ids_lock);
+}
+
+static int virtbus_add_ids(struct virtbus_drvr *virtbusdrvr)
+{
+	const struct virtbus_device_id *id = virtbusdrvr->id_table;
+	int ret = 0;
+
+	mutex_lock(&virtbus_ids_lock);
+	if (!id)
+		ret = virtbus_add_id(virtbusdrvr, NULL, virtbusdrvr->driver.name);
+	for (; id && id->compatible[0] && !ret; id++)
+		ret = virtbus_add_id(virtbusdrvr, id, id->compatible);
+	mutex_unlock(&virtbus_ids_lock);
+
+	if (ret)
+		virtbus_del_ids(virtbusdrvr);
+	return ret;
 }
 
 static void virtbus_release(struct device *dev)
@@ -29,10 +176,69 @@ struct device virtbus_represnted_dev = {
 	.release  = virtbus_release
 };
 
+static void virtbus_probe_account(u64 ns, int inflight, int ret)
+{
+	spin_lock(&virtbus_stats_lock);
+	virtbus_stats.probes++;
+	if (ret)
+		virtbus_stats.probe_fails++;
+	virtbus_stats.probe_ns += ns;
+	if (ns > virtbus_stats.probe_max_ns)
+		virtbus_stats.probe_max_ns = ns;
+	if (inflight > virtbus_stats.probe_max_inflight)
+		virtbus_stats.probe_max_inflight = inflight;
+	spin_unlock(&virtbus_stats_lock);
+}
+
+/**
+ * The driver core calls the bus probe instead of the driver's, which
+ * lets virtbus time every probe and see how many run in parallel.
+ */
+static int virtbus_probe(struct device *dev)
+{
+	struct virtbus_dev *virtbusdev = to_virtbus_dev(dev);
+	struct virtbus_drvr *virtbusdrvr = to_virtbus_drvr(dev->driver);
+	int inflight, ret = 0;
+	u64 start;
+
+	/** the id of the driver that won the bind, match only tested it */
+	if (!virtbus_lookup_id(virtbusdev, virtbusdrvr, &virtbusdev->id_entry))
+		ret = -ENODEV;
+	virtbusdev->driver = virtbusdrvr;
+	if (!ret && virtbusdrvr->driver.probe) {
+		inflight = atomic_inc_return(&virtbus_probing);
+		start = ktime_get_ns();
+		ret = virtbusdrvr->driver.probe(dev);
+		virtbus_probe_account(ktime_get_ns() - start, inflight, ret);
+		atomic_dec(&virtbus_probing);
+	}
+	if (ret) {
+		virtbusdev->driver = NULL;
+		virtbusdev->id_entry = NULL;
+	}
+
+	WRITE_ONCE(virtbusdev->probed, true);
+	if (wq_has_sleeper(&virtbus_probe_wq))
+		wake_up_all(&virtbus_probe_wq);
+	return ret;
+}
+
+static void virtbus_remove(struct device *dev)
+{
+	struct virtbus_dev *virtbusdev = to_virtbus_dev(dev);
+
+	if (dev->driver->remove)
+		dev->driver->remove(dev);
+	virtbusdev->driver = NULL;
+	virtbusdev->id_entry = NULL;
+}
+
 struct bus_type virtbus_type = {
 	.name = "virtbus",
 	.match = virtbus_match,
 	.uevent  = virtbus_uevent,
+	.probe = virtbus_probe,
+	.remove = virtbus_remove,
 };
 
 static void virtbus_dev_release(struct device *dev)
@@ -40,18 +246,197 @@ static void virtbus_dev_release(struct device *dev)
 	dev_info(dev, "virtbus device released");
 }
 
-int register_virtbus_device(struct virtbus_dev *virtbusdev)
+static void virtbus_dev_setup(struct virtbus_dev *virtbusdev,
+			void (*release)(struct device *))
 {
-	pr_info("A new device %s-%d registered to virtbus",
-		virtbusdev->name, virtbusdev->id);
-
 	virtbusdev->dev.bus = &virtbus_type;
 	virtbusdev->dev.parent = &virtbus_represnted_dev;
-	virtbusdev->dev.release = virtbus_dev_release;
+	virtbusdev->dev.release = release;
+	virtbusdev->probed = false;
+	virtbusdev->deleted = false;
+	if (!virtbusdev->compatible)
+		virtbusdev->compatible = virtbusdev->name;
+	virtbusdev->compat_hash = virtbus_hash(virtbusdev->compatible);
 
 	dev_set_name(&virtbusdev->dev,"%s-%d", virtbusdev->name, virtbusdev->id);
+}
+
+static int __register_virtbus_device(struct virtbus_dev *virtbusdev,
+			void (*release)(struct device *))
+{
+	virtbus_dev_setup(virtbusdev, release);
 	return device_register(&virtbusdev->dev);
 }
+
+/**
+ * Batch registration. device_add() of a device with a synchronous
+ * driver probes it before returning, so adding the devices one by one
+ * probes them one by one. Instead the array is cut into one chunk per
+ * online cpu and the chunks are added in parallel from the async
+ * workers. Probes of asynchronous drivers are scheduled by the driver
+ * core on its own. Settling afterwards waits for the probes of this
+ * batch only, not for every pending probe in the system.
+ */
+struct virtbus_batch {
+	unsigned int nr_chunks;
+	u64 start;
+	u64 added;
+};
+
+struct virtbus_batch_chunk {
+	struct virtbus_dev **devs;
+	unsigned int nr;
+	unsigned int added;
+	int ret;
+};
+
+static ASYNC_DOMAIN_EXCLUSIVE(virtbus_async_domain);
+
+static void virtbus_batch_add(void *data, async_cookie_t cookie)
+{
+	struct virtbus_batch_chunk *chunk = data;
+
+	for (chunk->added = 0; chunk->added < chunk->nr; chunk->added++) {
+		chunk->ret = device_add(&chunk->devs[chunk->added]->dev);
+		if (chunk->ret)
+			break;
+	}
+}
+
+static void virtbus_batch_account(unsigned int nr, unsigned int nr_chunks,
+			u64 add_ns, u64 settle_ns)
+{
+	spin_lock(&virtbus_stats_lock);
+	virtbus_stats.batches++;
+	virtbus_stats.batch_nr = nr;
+	virtbus_stats.batch_chunks = nr_chunks;
+	virtbus_stats.batch_add_ns = add_ns;
+	virtbus_stats.batch_settle_ns = settle_ns;
+	spin_unlock(&virtbus_stats_lock);
+}
+
+/**
+ * All or nothing: on failure the devices that were added are deleted
+ * again and every device has been released, as after a failed
+ * device_register().
+ */
+static int __register_virtbus_devices(struct virtbus_dev **devs,
+			unsigned int nr, void (*release)(struct device *),
+			struct virtbus_batch *bt)
+{
+	struct virtbus_batch_chunk *chunks;
+	unsigned int nr_chunks, per, i, j;
+	async_cookie_t cookie = 0;
+	int ret = 0;
+
+	if (!nr)
+		return 0;
+
+	bt->start = ktime_get_ns();
+	for (i = 0; i < nr; i++) {
+		device_initialize(&devs[i]->dev);
+		virtbus_dev_setup(devs[i], release);
+	}
+
+	per = DIV_ROUND_UP(nr, num_online_cpus());
+	nr_chunks = DIV_ROUND_UP(nr, per);
+	chunks = kcalloc(nr_chunks, sizeof(*chunks), GFP_KERNEL);
+	if (!chunks) {
+		ret = -ENOMEM;
+		goto put_devs;
+	}
+	for (i = 0; i < nr_chunks; i++) {
+		chunks[i].devs = devs + i * per;
+		chunks[i].nr = min(per, nr - i * per);
+		cookie = async_schedule_domain(virtbus_batch_add, &chunks[i],
+				&virtbus_async_domain);
+	}
+	/** up to this batch's last chunk, not the later concurrent batches */
+	async_synchronize_cookie_domain(cookie + 1, &virtbus_async_domain);
+	bt->added = ktime_get_ns();
+	bt->nr_chunks = nr_chunks;
+
+	for (i = 0; i < nr_chunks && !ret; i++)
+		ret = chunks[i].ret;
+	if (ret) {
+		for (i = 0; i < nr_chunks; i++)
+			for (j = 0; j < chunks[i].added; j++)
+				device_del(&chunks[i].devs[j]->dev);
+		goto free_chunks;
+	}
+
+	kfree(chunks);
+	return 0;
+
+free_chunks:
+	kfree(chunks);
+put_devs:
+	for (i = 0; i < nr; i++)
+		put_device(&devs[i]->dev);
+	return ret;
+}
+
+static int virtbus_has_driver(struct device_driver *driver, void *data)
+{
+	const struct virtbus_device_id *id;
+
+	return virtbus_lookup_id(data, to_virtbus_drvr(driver), &id);
+}
+
+/**
+ * A probe is still to come while the device is registered, not yet
+ * probed and some driver accepts it. Deletion and driver unregister
+ * wake virtbus_probe_wq, so a wait on this re-checks after either.
+ */
+static bool virtbus_probe_pending(struct virtbus_dev *virtbusdev)
+{
+	return !READ_ONCE(virtbusdev->probed) &&
+		!READ_ONCE(virtbusdev->deleted) &&
+		device_is_registered(&virtbusdev->dev) &&
+		bus_for_each_drv(&virtbus_type, NULL, virtbusdev,
+				virtbus_has_driver);
+}
+
+/**
+ * Wait until every device of the batch that some driver accepts has
+ * been probed, the synchronous ones already were in device_add(), and
+ * account the batch. The devices stay registered if interrupted.
+ */
+static void virtbus_batch_settle(struct virtbus_dev **devs, unsigned int nr,
+			struct virtbus_batch *bt)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (wait_event_interruptible(virtbus_probe_wq,
+					!virtbus_probe_pending(devs[i])))
+			return;
+	}
+	virtbus_batch_account(nr, bt->nr_chunks, bt->added - bt->start,
+			ktime_get_ns() - bt->added);
+}
+
+int register_virtbus_devices(struct virtbus_dev **devs, unsigned int nr)
+{
+	struct virtbus_batch bt;
+	int ret;
+
+	pr_info("%u devices registered to virtbus in a batch", nr);
+
+	ret = __register_virtbus_devices(devs, nr, virtbus_dev_release, &bt);
+	if (!ret && nr)
+		virtbus_batch_settle(devs, nr, &bt);
+	return ret;
+}
+EXPORT_SYMBOL(register_virtbus_devices);
+
+int register_virtbus_device(struct virtbus_dev *virtbusdev)
+{
+	pr_info("A new device %s-%d registered to virtbus",
+		virtbusdev->name, virtbusdev->id);
+
+	return __register_virtbus_device(virtbusdev, virtbus_dev_release);
+}
 EXPORT_SYMBOL(register_virtbus_device);
 
 void unregister_virtbus_device(struct virtbus_dev *virtbusdev)
@@ -65,7 +450,16 @@ int register_virtbus_driver(struct virtbus_drvr *virtbusdrvr)
 	int ret;
 	pr_info("A new driver %s registered to virtbus", virtbusdrvr->driver.name);
 	virtbusdrvr->driver.bus = &virtbus_type;
+	if (async_probe &&
+	    virtbusdrvr->driver.probe_type == PROBE_DEFAULT_STRATEGY)
+		virtbusdrvr->driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
+	/** the ids must be visible before driver_register() binds devices */
+	ret = virtbus_add_ids(virtbusdrvr);
+	if (ret)
+		return ret;
 	ret = driver_register(&virtbusdrvr->driver);
+	if (ret)
+		virtbus_del_ids(virtbusdrvr);
 	
 	return ret;
 }
@@ -75,27 +469,507 @@ void unregister_virtbus_driver(struct virtbus_drvr *virtbusdrvr)
 {
 	pr_info("A driver %s unregistered to virtbus", virtbusdrvr->driver.name);
 	driver_unregister(&virtbusdrvr->driver);
+	virtbus_del_ids(virtbusdrvr);
+	/** batches waiting on a probe by this driver give up */
+	wake_up_all(&virtbus_probe_wq);
 }
 EXPORT_SYMBOL(unregister_virtbus_driver);
 
+/**
+ * Split-ring transport. One allocation holds the descriptor table,
+ * the available ring and, on its own cache line so the two sides do
+ * not false-share, the used ring. Only single-descriptor buffers are
+ * used; the free descriptors are chained through desc.next.
+ */
+struct virtbus_vq *virtbus_vq_create(unsigned int num)
+{
+	struct virtbus_vq *vq;
+	size_t desc_sz, avail_sz, used_off, used_sz;
+	unsigned int i;
+
+	if (!num || !is_power_of_2(num) || num > 32768)
+		return ERR_PTR(-EINVAL);
+
+	vq = kzalloc(sizeof(*vq), GFP_KERNEL);
+	if (!vq)
+		return ERR_PTR(-ENOMEM);
+	vq->token = kcalloc(num, sizeof(*vq->token), GFP_KERNEL);
+	if (!vq->token)
+		goto err_free_vq;
+
+	desc_sz = num * sizeof(struct virtbus_vring_desc);
+	avail_sz = struct_size(vq->avail, ring, num);
+	used_off = ALIGN(desc_sz + avail_sz, SMP_CACHE_BYTES);
+	used_sz = struct_size(vq->used, ring, num);
+	vq->ring_size = PAGE_ALIGN(used_off + used_sz);
+	vq->ring = alloc_pages_exact(vq->ring_size, GFP_KERNEL | __GFP_ZERO);
+	if (!vq->ring)
+		goto err_free_token;
+
+	vq->num = num;
+	vq->desc = vq->ring;
+	vq->avail = vq->ring + desc_sz;
+	vq->used = vq->ring + used_off;
+	for (i = 0; i < num - 1; i++)
+		vq->desc[i].next = i + 1;
+	vq->num_free = num;
+	return vq;
+
+err_free_token:
+	kfree(vq->token);
+err_free_vq:
+	kfree(vq);
+	return ERR_PTR(-ENOMEM);
+}
+EXPORT_SYMBOL(virtbus_vq_create);
+
+void virtbus_vq_destroy(struct virtbus_vq *vq)
+{
+	free_pages_exact(vq->ring, vq->ring_size);
+	kfree(vq->token);
+	kfree(vq);
+}
+EXPORT_SYMBOL(virtbus_vq_destroy);
+
+int virtbus_vq_add_buf(struct virtbus_vq *vq, void *buf, u32 len,
+			u16 flags, void *token)
+{
+	u16 head;
+
+	if (!vq->num_free)
+		return -ENOSPC;
+
+	head = vq->free_head;
+	vq->free_head = vq->desc[head].next;
+	vq->num_free--;
+
+	vq->desc[head].addr = (u64)(uintptr_t)buf;
+	vq->desc[head].len = len;
+	vq->desc[head].flags = flags;
+	vq->token[head] = token;
+	vq->avail->ring[vq->avail_idx & (vq->num - 1)] = head;
+	vq->avail_idx++;
+	return 0;
+}
+EXPORT_SYMBOL(virtbus_vq_add_buf);
+
+/**
+ * Publish everything added since the last kick. Returns true if the
+ * device asked to be kicked, false if it was busy and suppressed it.
+ */
+bool virtbus_vq_kick(struct virtbus_vq *vq)
+{
+	/** descriptors and ring entries before the index */
+	smp_wmb();
+	WRITE_ONCE(vq->avail->idx, vq->avail_idx);
+	/** the index before reading the device's flags */
+	smp_mb();
+	if (READ_ONCE(vq->used->flags) & VIRTBUS_VRING_USED_F_NO_NOTIFY)
+		return false;
+	vq->kicks++;
+	vq->kick(vq);
+	return true;
+}
+EXPORT_SYMBOL(virtbus_vq_kick);
+
+void *virtbus_vq_get_buf(struct virtbus_vq *vq, u32 *len)
+{
+	struct virtbus_vring_used_elem *elem;
+	void *token;
+	u16 id;
+
+	if (vq->last_used_idx == READ_ONCE(vq->used->idx))
+		return NULL;
+	/** the index before the entry it covers */
+	smp_rmb();
+	elem = &vq->used->ring[vq->last_used_idx & (vq->num - 1)];
+	id = elem->id;
+	if (len)
+		*len = elem->len;
+	token = vq->token[id];
+	vq->token[id] = NULL;
+	vq->desc[id].next = vq->free_head;
+	vq->free_head = id;
+	vq->num_free++;
+	vq->last_used_idx++;
+	return token;
+}
+EXPORT_SYMBOL(virtbus_vq_get_buf);
+
+void virtbus_vq_disable_cb(struct virtbus_vq *vq)
+{
+	WRITE_ONCE(vq->avail->flags, VIRTBUS_VRING_AVAIL_F_NO_INTERRUPT);
+}
+EXPORT_SYMBOL(virtbus_vq_disable_cb);
+
+/**
+ * Returns true if buffers came back while callbacks were off, the
+ * caller has to drain again then.
+ */
+bool virtbus_vq_enable_cb(struct virtbus_vq *vq)
+{
+	WRITE_ONCE(vq->avail->flags, 0);
+	smp_mb();
+	return vq->last_used_idx != READ_ONCE(vq->used->idx);
+}
+EXPORT_SYMBOL(virtbus_vq_enable_cb);
+
+/**
+ * After clearing notify, wait for a device that may still be calling
+ * the old one
+ */
+void virtbus_vq_sync(struct virtbus_vq *vq)
+{
+	if (vq->sync)
+		vq->sync(vq);
+}
+EXPORT_SYMBOL(virtbus_vq_sync);
+
+struct virtbus_vring_desc *virtbus_vq_pop(struct virtbus_vq *vq, u16 *head)
+{
+	if (vq->last_avail_idx == READ_ONCE(vq->avail->idx))
+		return NULL;
+	smp_rmb();
+	*head = vq->avail->ring[vq->last_avail_idx & (vq->num - 1)];
+	vq->last_avail_idx++;
+	return &vq->desc[*head];
+}
+EXPORT_SYMBOL(virtbus_vq_pop);
+
+void virtbus_vq_push(struct virtbus_vq *vq, u16 head, u32 len)
+{
+	u16 idx = vq->used->idx;
+
+	vq->used->ring[idx & (vq->num - 1)].id = head;
+	vq->used->ring[idx & (vq->num - 1)].len = len;
+	smp_wmb();
+	WRITE_ONCE(vq->used->idx, idx + 1);
+}
+EXPORT_SYMBOL(virtbus_vq_push);
+
+/**
+ * Tell the driver about everything pushed so far, one call can cover
+ * a whole batch. Returns false if the driver suppressed it.
+ */
+bool virtbus_vq_notify(struct virtbus_vq *vq)
+{
+	void (*notify)(struct virtbus_vq *vq);
+
+	smp_mb();
+	if (READ_ONCE(vq->avail->flags) & VIRTBUS_VRING_AVAIL_F_NO_INTERRUPT)
+		return false;
+	notify = READ_ONCE(vq->notify);
+	if (!notify)
+		return false;
+	vq->notifies++;
+	notify(vq);
+	return true;
+}
+EXPORT_SYMBOL(virtbus_vq_notify);
+
+void virtbus_vq_disable_kick(struct virtbus_vq *vq)
+{
+	WRITE_ONCE(vq->used->flags, VIRTBUS_VRING_USED_F_NO_NOTIFY);
+}
+EXPORT_SYMBOL(virtbus_vq_disable_kick);
+
+bool virtbus_vq_enable_kick(struct virtbus_vq *vq)
+{
+	WRITE_ONCE(vq->used->flags, 0);
+	smp_mb();
+	return vq->last_avail_idx != READ_ONCE(vq->avail->idx);
+}
+EXPORT_SYMBOL(virtbus_vq_enable_kick);
+
+/**
+ * Devices created from user space through the bus attributes:
+ *   echo "name id" > /sys/bus/virtbus/new_device
+ *   echo "name first count" > /sys/bus/virtbus/bulk_new_device
+ *   echo "name first [count]" > /sys/bus/virtbus/delete_device
+ * The bus owns their memory, the release callback frees it. Bulk
+ * devices are registered with their uevents suppressed and announced
+ * by a single change event on the virtbus device instead, so creating
+ * thousands of them does not flood udev. They are added in parallel
+ * through the batch registration, all or none of them.
+ */
+#define VIRTBUS_MAX_BULK	(65536)
+
+struct virtbus_sysfs_dev {
+	struct virtbus_dev virtbusdev;
+	struct list_head node;
+};
+
+#define to_virtbus_sysfs_dev(d)	container_of(d, struct virtbus_sysfs_dev, virtbusdev)
+
+static LIST_HEAD(virtbus_sysfs_devs);
+static DEFINE_MUTEX(virtbus_sysfs_lock);
+
+static void virtbus_sysfs_free(struct virtbus_sysfs_dev *sdev)
+{
+	kfree(sdev->virtbusdev.name);
+	kfree(sdev);
+}
+
+static void virtbus_sysfs_dev_release(struct device *dev)
+{
+	virtbus_sysfs_free(to_virtbus_sysfs_dev(to_virtbus_dev(dev)));
+}
+
+static struct virtbus_sysfs_dev *virtbus_sysfs_alloc(const char *name, int id,
+			bool quiet)
+{
+	struct virtbus_sysfs_dev *sdev;
+
+	sdev = kzalloc(sizeof(*sdev), GFP_KERNEL);
+	if (!sdev)
+		return NULL;
+	sdev->virtbusdev.name = kstrdup(name, GFP_KERNEL);
+	if (!sdev->virtbusdev.name) {
+		kfree(sdev);
+		return NULL;
+	}
+	sdev->virtbusdev.id = id;
+	if (quiet)
+		dev_set_uevent_suppress(&sdev->virtbusdev.dev, 1);
+	return sdev;
+}
+
+/**
+ * Called with virtbus_sysfs_lock held
+ */
+static int virtbus_sysfs_add(const char *name, int id, bool quiet)
+{
+	struct virtbus_sysfs_dev *sdev;
+	int ret;
+
+	sdev = virtbus_sysfs_alloc(name, id, quiet);
+	if (!sdev)
+		return -ENOMEM;
+
+	ret = __register_virtbus_device(&sdev->virtbusdev,
+				virtbus_sysfs_dev_release);
+	if (ret) {
+		/** frees sdev through the release callback */
+		put_device(&sdev->virtbusdev.dev);
+		return ret;
+	}
+	list_add_tail(&sdev->node, &virtbus_sysfs_devs);
+	return 0;
+}
+
+static ssize_t new_device_store(struct bus_type *bus, const char *buf,
+			size_t count)
+{
+	char name[VIRTBUS_NAME_SIZE];
+	int id, ret;
+
+	if (sscanf(buf, "%31s %d", name, &id) != 2)
+		return -EINVAL;
+
+	mutex_lock(&virtbus_sysfs_lock);
+	ret = virtbus_sysfs_add(name, id, false);
+	mutex_unlock(&virtbus_sysfs_lock);
+
+	return ret ? ret : count;
+}
+static BUS_ATTR_WO(new_device);
+
+static ssize_t bulk_new_device_store(struct bus_type *bus, const char *buf,
+			size_t count)
+{
+	char name[VIRTBUS_NAME_SIZE];
+	char env_bulk[VIRTBUS_NAME_SIZE + 48];
+	char *envp[] = { env_bulk, NULL };
+	struct virtbus_sysfs_dev *sdev;
+	struct virtbus_dev **devs;
+	struct virtbus_batch bt;
+	unsigned int nr, i;
+	int first, ret = 0;
+
+	if (sscanf(buf, "%31s %d %u", name, &first, &nr) != 3)
+		return -EINVAL;
+	if (!nr || nr > VIRTBUS_MAX_BULK)
+		return -EINVAL;
+
+	devs = kvmalloc_array(nr, sizeof(*devs), GFP_KERNEL);
+	if (!devs)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++) {
+		sdev = virtbus_sysfs_alloc(name, first + i, true);
+		if (!sdev) {
+			ret = -ENOMEM;
+			goto free_sdevs;
+		}
+		devs[i] = &sdev->virtbusdev;
+	}
+
+	mutex_lock(&virtbus_sysfs_lock);
+	/** on failure the release callback has freed every sdev */
+	ret = __register_virtbus_devices(devs, nr, virtbus_sysfs_dev_release,
+				&bt);
+	for (i = 0; i < nr && !ret; i++) {
+		list_add_tail(&to_virtbus_sysfs_dev(devs[i])->node,
+				&virtbus_sysfs_devs);
+		/** delete_device may free them once the lock is dropped */
+		get_device(&devs[i]->dev);
+	}
+	mutex_unlock(&virtbus_sysfs_lock);
+
+	if (!ret) {
+		virtbus_batch_settle(devs, nr, &bt);
+		for (i = 0; i < nr; i++)
+			put_device(&devs[i]->dev);
+		snprintf(env_bulk, sizeof(env_bulk), "VIRTBUS_BULK_ADD=%s %d %u",
+			name, first, nr);
+		kobject_uevent_env(&virtbus_represnted_dev.kobj, KOBJ_CHANGE, envp);
+	}
+	kvfree(devs);
+	return ret ? ret : count;
+
+free_sdevs:
+	while (i--)
+		virtbus_sysfs_free(to_virtbus_sysfs_dev(devs[i]));
+	kvfree(devs);
+	return ret;
+}
+static BUS_ATTR_WO(bulk_new_device);
+
+static ssize_t delete_device_store(struct bus_type *bus, const char *buf,
+			size_t count)
+{
+	char name[VIRTBUS_NAME_SIZE];
+	struct virtbus_sysfs_dev *sdev, *tmp;
+	unsigned int nr = 1, found = 0;
+	int first;
+
+	if (sscanf(buf, "%31s %d %u", name, &first, &nr) < 2 || !nr)
+		return -EINVAL;
+
+	mutex_lock(&virtbus_sysfs_lock);
+	list_for_each_entry_safe(sdev, tmp, &virtbus_sysfs_devs, node) {
+		if (strcmp(sdev->virtbusdev.name, name) ||
+		    sdev->virtbusdev.id < first ||
+		    sdev->virtbusdev.id - first >= nr)
+			continue;
+		list_del(&sdev->node);
+		unregister_virtbus_device(&sdev->virtbusdev);
+		found++;
+	}
+	mutex_unlock(&virtbus_sysfs_lock);
+
+	return found ? count : -ENODEV;
+}
+static BUS_ATTR_WO(delete_device);
+
+static struct attribute *virtbus_attrs[] = {
+	&bus_attr_new_device.attr,
+	&bus_attr_bulk_new_device.attr,
+	&bus_attr_delete_device.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(virtbus);
+
+static void virtbus_sysfs_del_all(void)
+{
+	struct virtbus_sysfs_dev *sdev, *tmp;
+
+	mutex_lock(&virtbus_sysfs_lock);
+	list_for_each_entry_safe(sdev, tmp, &virtbus_sysfs_devs, node) {
+		list_del(&sdev->node);
+		unregister_virtbus_device(&sdev->virtbusdev);
+	}
+	mutex_unlock(&virtbus_sysfs_lock);
+}
+
+static int virtbus_stats_show(struct seq_file *m, void *v)
+{
+	struct virtbus_stats st;
+	u64 batch_ns;
+
+	spin_lock(&virtbus_stats_lock);
+	st = virtbus_stats;
+	spin_unlock(&virtbus_stats_lock);
+
+	seq_printf(m, "async_probe: %d cpus: %u\n", async_probe,
+			num_online_cpus());
+	seq_printf(m, "probes: %llu failed: %llu avg: %llu ns max: %llu ns max parallel: %d\n",
+			st.probes, st.probe_fails,
+			st.probes ? div64_u64(st.probe_ns, st.probes) : 0,
+			st.probe_max_ns, st.probe_max_inflight);
+	if (!st.batches)
+		return 0;
+	batch_ns = st.batch_add_ns + st.batch_settle_ns;
+	seq_printf(m, "batches: %llu last: %u devices in %u chunks add: %llu us settle: %llu us %llu devices/s\n",
+			st.batches, st.batch_nr, st.batch_chunks,
+			div_u64(st.batch_add_ns, NSEC_PER_USEC),
+			div_u64(st.batch_settle_ns, NSEC_PER_USEC),
+			div64_u64((u64)st.batch_nr * NSEC_PER_SEC,
+				batch_ns ? batch_ns : 1));
+	return 0;
+}
+
+static int virtbus_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, virtbus_stats_show, NULL);
+}
+
+static const struct file_operations virtbus_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = virtbus_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/**
+ * The driver core skips the pending async probe of a deleted device,
+ * so a batch waiting for it has to be told.
+ */
+static int virtbus_notify(struct notifier_block *nb, unsigned long action,
+			void *data)
+{
+	struct device *dev = data;
+
+	if (action != BUS_NOTIFY_DEL_DEVICE)
+		return NOTIFY_DONE;
+	WRITE_ONCE(to_virtbus_dev(dev)->deleted, true);
+	wake_up_all(&virtbus_probe_wq);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block virtbus_nb = {
+	.notifier_call = virtbus_notify
+};
+
 static int __init virtbus_init(void)
 {
 	int ret;
 
+	virtbus_type.bus_groups = virtbus_groups;
 	ret = bus_register(&virtbus_type);
 	if (ret) {
 		pr_err("Unable to register to virtbus, %d\n",ret);
 		return ret;
 	}
+	ret = bus_register_notifier(&virtbus_type, &virtbus_nb);
+	if (ret) {
+		pr_err("Unable to register virtbus notifier %d\n",ret);
+		goto unreg_bus;
+	}
 	dev_set_name(&virtbus_represnted_dev,"virtbus");
 	ret = device_register(&virtbus_represnted_dev);
 	if (ret) {
 		pr_err("Unable to create represnted device of virtbus %d\n",ret);
-		goto unreg_bus;
+		goto unreg_notifier;
 	}
+	virtbus_dbg_dir = debugfs_create_dir("virtbus", NULL);
+	debugfs_create_file("stats", S_IRUSR, virtbus_dbg_dir, NULL,
+			&virtbus_stats_fops);
 	pr_info("...virtbus_init...\n");
 	return 0;
 
+unreg_notifier:
+	bus_unregister_notifier(&virtbus_type, &virtbus_nb);
 unreg_bus:
 	bus_unregister(&virtbus_type);
 	return ret;
@@ -104,8 +978,13 @@ unreg_bus:
 static void virtbus_exit(void)
 {
 	pr_info("...virtbus_exit...\n");
+	debugfs_remove_recursive(virtbus_dbg_dir);
+	virtbus_sysfs_del_all();
 	device_unregister(&virtbus_represnted_dev);
+	bus_unregister_notifier(&virtbus_type, &virtbus_nb);
 	bus_unregister(&virtbus_type);
+	/** wait for the kfree_rcu() of the last driver's ids */
+	rcu_barrier();
 }
 module_init(virtbus_init);
 module_exit(virtbus_exit);
@@ -1,21 +1,144 @@
+#define VIRTBUS_NAME_SIZE	32
+
+/*
+ * One entry of a driver's id table, the table ends with an entry
+ * whose compatible is empty.
+ */
+struct virtbus_device_id {
+	char compatible[VIRTBUS_NAME_SIZE];
+	kernel_ulong_t driver_data;
+};
+
 struct virtbus_drvr {
 	/*
 	 * For simplicity only embed device_driver.
 	 * However we can add different attributes
 	 * for the bus as well.
+	 * driver.probe_type picks synchronous or asynchronous probing,
+	 * PROBE_DEFAULT_STRATEGY follows virtbus' async_probe parameter.
 	 */
 	struct device_driver driver;
+	/*
+	 * Devices whose compatible equals one of the entries bind to
+	 * this driver. Without a table the driver name is used.
+	 */
+	const struct virtbus_device_id *id_table;
+};
+
+/*
+ * Optional split-ring transport, laid out like a virtio ring in one
+ * shared allocation. The driver side adds buffers to the available
+ * ring and kicks, the device side pops them, pushes them to the used
+ * ring and notifies. Addresses are kernel virtual addresses, buffers
+ * are handed over in place.
+ */
+#define VIRTBUS_VRING_DESC_F_WRITE	2	/* device writes the buffer */
+#define VIRTBUS_VRING_AVAIL_F_NO_INTERRUPT	1
+#define VIRTBUS_VRING_USED_F_NO_NOTIFY	1
+
+struct virtbus_vring_desc {
+	u64 addr;
+	u32 len;
+	u16 flags;
+	u16 next;
+};
+
+struct virtbus_vring_avail {
+	u16 flags;
+	u16 idx;
+	u16 ring[];
+};
+
+struct virtbus_vring_used_elem {
+	u32 id;
+	u32 len;
+};
+
+struct virtbus_vring_used {
+	u16 flags;
+	u16 idx;
+	struct virtbus_vring_used_elem ring[];
+};
+
+struct virtbus_vq {
+	unsigned int num;
+	void *ring;
+	size_t ring_size;
+	struct virtbus_vring_desc *desc;
+	struct virtbus_vring_avail *avail;
+	struct virtbus_vring_used *used;
+	/* driver side state, serialized by the driver */
+	void **token;
+	u16 free_head;
+	u16 num_free;
+	u16 avail_idx;
+	u16 last_used_idx;
+	unsigned long kicks;
+	/* device side state, serialized by the device */
+	u16 last_avail_idx;
+	unsigned long notifies;
+	/*
+	 * kick is set by the device and called when the driver publishes
+	 * buffers, notify is set by the driver and called when the device
+	 * returns them. Either may be suppressed by the other side.
+	 * sync is set by the device and returns once no kick handling,
+	 * and so no notify call, is running any more.
+	 */
+	void (*kick)(struct virtbus_vq *vq);
+	void (*notify)(struct virtbus_vq *vq);
+	void (*sync)(struct virtbus_vq *vq);
+	void *dev_priv;
+	void *drv_priv;
 };
 
 struct virtbus_dev {
 	char *name;
 	int id;
+	/*
+	 * Matched against the driver id tables, defaults to name.
+	 * compat_hash is filled at registration, id_entry by probe.
+	 */
+	const char *compatible;
+	u32 compat_hash;
+	const struct virtbus_device_id *id_entry;
+	/* set up by the device side before registration, may be empty */
+	struct virtbus_vq **vqs;
+	unsigned int nr_vqs;
 	struct virtbus_drvr *driver;
+	/*
+	 * set by the bus once a driver's probe ran, or once the device is
+	 * being deleted and no probe will come, see the batch API
+	 */
+	bool probed;
+	bool deleted;
 	struct device dev;
 };
 
+#define to_virtbus_dev(d)	container_of(d, struct virtbus_dev, dev)
+#define to_virtbus_drvr(d)	container_of(d, struct virtbus_drvr, driver)
+
 extern struct bus_type virtbus_type;
 extern int register_virtbus_device(struct virtbus_dev *virtbusdev);
 extern void unregister_virtbus_device(struct virtbus_dev *virtbusdev);
+/* adds the devices in parallel, on failure all of them are released */
+extern int register_virtbus_devices(struct virtbus_dev **devs, unsigned int nr);
 extern int register_virtbus_driver(struct virtbus_drvr *virtbusdrvr);
 extern void unregister_virtbus_driver(struct virtbus_drvr *virtbusdrvr);
+
+extern struct virtbus_vq *virtbus_vq_create(unsigned int num);
+extern void virtbus_vq_destroy(struct virtbus_vq *vq);
+/* driver side */
+extern int virtbus_vq_add_buf(struct virtbus_vq *vq, void *buf, u32 len,
+			u16 flags, void *token);
+extern bool virtbus_vq_kick(struct virtbus_vq *vq);
+extern void *virtbus_vq_get_buf(struct virtbus_vq *vq, u32 *len);
+extern void virtbus_vq_disable_cb(struct virtbus_vq *vq);
+extern bool virtbus_vq_enable_cb(struct virtbus_vq *vq);
+extern void virtbus_vq_sync(struct virtbus_vq *vq);
+/* device side */
+extern struct virtbus_vring_desc *virtbus_vq_pop(struct virtbus_vq *vq,
+			u16 *head);
+extern void virtbus_vq_push(struct virtbus_vq *vq, u16 head, u32 len);
+extern bool virtbus_vq_notify(struct virtbus_vq *vq);
+extern void virtbus_vq_disable_kick(struct virtbus_vq *vq);
+extern bool virtbus_vq_enable_kick(struct virtbus_vq *vq);
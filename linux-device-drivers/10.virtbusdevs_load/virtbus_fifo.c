@@ -0,0 +1,674 @@
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/kfifo.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "virtbus.h"
+
+MODULE_AUTHOR("Arabic Linux Community");
+MODULE_DESCRIPTION("virtbus multi-queue fifo driver");
+MODULE_LICENSE("GPL");
+
+#define BASE_MINORS		(0)
+#define NR_MINOR_DEVCS		(256)
+#define DEVICE_NAME		"virtbus-fifo"
+#define DEVICE_CLASS		"virtbus-fifoclass"
+#define VFIFO_MSG_SIZE		(64)
+
+/**
+ * Bytes per queue, and whether the char devices use one shared queue
+ * instead of one per cpu.
+ */
+static unsigned int qsize = 4096;
+module_param(qsize, uint, 0);
+static bool shared;
+module_param(shared, bool, 0);
+
+/**
+ * /sys/kernel/debug/virtbus_fifo/bench: messages each producer or pair moves
+ */
+static unsigned int benchops = 200000;
+module_param(benchops, uint, 0);
+
+/**
+ * A set of queues, one per possible cpu, or only q[0] when shared.
+ * Writers queue on their own cpu; readers take from their own cpu
+ * and steal from the others when it is empty. Ordering is per queue,
+ * not per device, like a multi-queue NIC.
+ */
+struct vfifo_queue {
+	spinlock_t lock;
+	struct kfifo fifo;
+	unsigned long steals;
+} ____cacheline_aligned_in_smp;
+
+struct vfifo_qset {
+	struct vfifo_queue *q;
+	bool shared;
+};
+
+/**
+ * Open files keep a reference, so the queues outlive remove until the
+ * last close. Remove marks the device gone and wakes the sleepers. The
+ * cdev is allocated on its own, an open racing with cdev_del() holds
+ * it, and finds the device through the minors idr or not at all.
+ */
+struct vfifo_dev {
+	struct kref ref;
+	struct vfifo_qset qs;
+	struct cdev *new_cdevice;
+	dev_t devnr;
+	wait_queue_head_t rd_wq;
+	wait_queue_head_t wr_wq;
+	bool gone;
+};
+
+struct vfifo_drv {
+	dev_t b_devnr;
+	struct class *new_class;
+	struct idr minors;	/** minor -> vfifo_dev, under lock */
+	struct mutex lock;
+	struct dentry *dbg_dir;
+};
+static struct vfifo_drv vfifo_drv;
+
+static void vfifo_qset_free(struct vfifo_qset *qs)
+{
+	int cpu;
+
+	if (!qs->q)
+		return;
+	for_each_possible_cpu(cpu)
+		kfifo_free(&qs->q[cpu].fifo);
+	kfree(qs->q);
+	qs->q = NULL;
+}
+
+static int vfifo_qset_alloc(struct vfifo_qset *qs, bool is_shared)
+{
+	int cpu, ret;
+
+	qs->shared = is_shared;
+	qs->q = kcalloc(nr_cpu_ids, sizeof(*qs->q), GFP_KERNEL);
+	if (!qs->q)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		spin_lock_init(&qs->q[cpu].lock);
+		if (is_shared && cpu != cpumask_first(cpu_possible_mask))
+			continue;
+		ret = kfifo_alloc(&qs->q[cpu].fifo, qsize, GFP_KERNEL);
+		if (ret) {
+			vfifo_qset_free(qs);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static struct vfifo_queue *vfifo_local(struct vfifo_qset *qs)
+{
+	if (qs->shared)
+		return &qs->q[cpumask_first(cpu_possible_mask)];
+	return &qs->q[raw_smp_processor_id()];
+}
+
+/**
+ * Queue at least min and at most len bytes, or nothing
+ */
+static unsigned int vfifo_enqueue(struct vfifo_qset *qs, const void *buf,
+				unsigned int len, unsigned int min)
+{
+	struct vfifo_queue *q = vfifo_local(qs);
+	unsigned int n = 0;
+
+	spin_lock(&q->lock);
+	if (kfifo_avail(&q->fifo) >= min)
+		n = kfifo_in(&q->fifo, buf, len);
+	spin_unlock(&q->lock);
+	return n;
+}
+
+static unsigned int vfifo_take(struct vfifo_queue *q, void *buf,
+				unsigned int len, unsigned int min)
+{
+	unsigned int n = 0;
+
+	/** a racy peek keeps readers off the locks of empty queues */
+	if (kfifo_len(&q->fifo) < min)
+		return 0;
+	spin_lock(&q->lock);
+	if (kfifo_len(&q->fifo) >= min)
+		n = kfifo_out(&q->fifo, buf, len);
+	spin_unlock(&q->lock);
+	return n;
+}
+
+/**
+ * Dequeue at least min and at most len bytes from one queue, the
+ * local one first, or nothing
+ */
+static unsigned int vfifo_dequeue(struct vfifo_qset *qs, void *buf,
+				unsigned int len, unsigned int min)
+{
+	struct vfifo_queue *q = vfifo_local(qs);
+	unsigned int n, i;
+	int cpu;
+
+	n = vfifo_take(q, buf, len, min);
+	if (n || qs->shared)
+		return n;
+
+	cpu = q - qs->q;
+	for (i = 1; i < nr_cpu_ids; i++) {
+		cpu = cpumask_next(cpu, cpu_possible_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_possible_mask);
+		if (&qs->q[cpu] == q)
+			break;
+		n = vfifo_take(&qs->q[cpu], buf, len, min);
+		if (n) {
+			/** counted on the thief's queue, no shared line */
+			q->steals++;
+			return n;
+		}
+	}
+	return 0;
+}
+
+static bool vfifo_has_data(struct vfifo_qset *qs)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (!kfifo_is_empty(&qs->q[cpu].fifo))
+			return true;
+	return false;
+}
+
+/** room in the queue a write from this cpu would go to, racy */
+static bool vfifo_has_room(struct vfifo_qset *qs)
+{
+	return !kfifo_is_full(&vfifo_local(qs)->fifo);
+}
+
+static void vfifo_dev_free(struct kref *ref)
+{
+	struct vfifo_dev *vdev = container_of(ref, struct vfifo_dev, ref);
+
+	vfifo_qset_free(&vdev->qs);
+	kfree(vdev);
+}
+
+static int vfifo_open(struct inode *inode, struct file *filp)
+{
+	struct vfifo_dev *vdev;
+
+	mutex_lock(&vfifo_drv.lock);
+	vdev = idr_find(&vfifo_drv.minors, iminor(inode));
+	if (vdev)
+		kref_get(&vdev->ref);
+	mutex_unlock(&vfifo_drv.lock);
+	if (!vdev)
+		return -ENODEV;
+
+	filp->private_data = vdev;
+	return 0;
+}
+
+static int vfifo_release(struct inode *inode, struct file *filp)
+{
+	struct vfifo_dev *vdev = filp->private_data;
+
+	kref_put(&vdev->ref, vfifo_dev_free);
+	return 0;
+}
+
+/**
+ * Short writes when the local queue fills up. When nothing fits it
+ * blocks until a reader made room, or fails with -EAGAIN for
+ * O_NONBLOCK.
+ */
+static ssize_t vfifo_write(struct file *file, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	struct vfifo_dev *dev = file->private_data;
+	unsigned int len = min_t(size_t, count, PAGE_SIZE);
+	unsigned int n;
+	void *kbuf;
+
+	if (!count)
+		return 0;
+	if (READ_ONCE(dev->gone))
+		return -ENODEV;
+	kbuf = kmalloc(len, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+	if (copy_from_user(kbuf, buf, len)) {
+		kfree(kbuf);
+		return -EFAULT;
+	}
+	while (!(n = vfifo_enqueue(&dev->qs, kbuf, len, 1))) {
+		if (READ_ONCE(dev->gone)) {
+			kfree(kbuf);
+			return -ENODEV;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			kfree(kbuf);
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(dev->wr_wq, vfifo_has_room(&dev->qs) ||
+					READ_ONCE(dev->gone))) {
+			kfree(kbuf);
+			return -ERESTARTSYS;
+		}
+	}
+	kfree(kbuf);
+
+	if (wq_has_sleeper(&dev->rd_wq))
+		wake_up_interruptible(&dev->rd_wq);
+	return n;
+}
+
+static ssize_t vfifo_read(struct file *file, char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	struct vfifo_dev *dev = file->private_data;
+	unsigned int len = min_t(size_t, count, PAGE_SIZE);
+	unsigned int n;
+	ssize_t ret;
+	void *kbuf;
+
+	if (!count)
+		return 0;
+	kbuf = kmalloc(len, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	while (!(n = vfifo_dequeue(&dev->qs, kbuf, len, 1))) {
+		if (READ_ONCE(dev->gone)) {
+			kfree(kbuf);
+			return -ENODEV;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			kfree(kbuf);
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(dev->rd_wq, vfifo_has_data(&dev->qs) ||
+					READ_ONCE(dev->gone))) {
+			kfree(kbuf);
+			return -ERESTARTSYS;
+		}
+	}
+
+	if (wq_has_sleeper(&dev->wr_wq))
+		wake_up_interruptible(&dev->wr_wq);
+	/** a bad buffer loses the message, as with any consuming read */
+	ret = copy_to_user(buf, kbuf, n) ? -EFAULT : n;
+	kfree(kbuf);
+	return ret;
+}
+
+static const struct file_operations vfifo_fops = {
+	.owner = THIS_MODULE,
+	.open = vfifo_open,
+	.release = vfifo_release,
+	.read = vfifo_read,
+	.write = vfifo_write,
+	.llseek = no_llseek
+};
+
+/**
+ * Benchmark, both queue layouts with 2, 4 .. all online cpus, each
+ * thread bound to its own cpu and moving benchops messages of
+ * VFIFO_MSG_SIZE:
+ *   split:  half the threads produce, half consume, so with per-cpu
+ *           queues every message is stolen from another cpu.
+ *   paired: every thread is a co-located producer/consumer pair that
+ *           queues a message and takes one back, the local fast path.
+ */
+enum vfifo_role {
+	VFIFO_PRODUCER,
+	VFIFO_CONSUMER,
+	VFIFO_PAIRED,
+};
+struct vfifo_bench {
+	struct vfifo_qset qs;
+	struct completion go;
+	struct completion done;
+	atomic_t left;
+};
+
+struct vfifo_worker {
+	struct task_struct *task;
+	struct vfifo_bench *b;
+	enum vfifo_role role;
+};
+
+/**
+ * kthread_stop() needs the thread alive, so park until asked to stop
+ */
+static void vfifo_wait_stop(void)
+{
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+static int vfifo_worker_fn(void *arg)
+{
+	struct vfifo_worker *w = arg;
+	struct vfifo_bench *b = w->b;
+	u8 msg[VFIFO_MSG_SIZE];
+	unsigned int i = 0, n;
+	bool held = false;	/** paired: own message queued, take one back */
+
+	memset(msg, 0x5a, sizeof(msg));
+	wait_for_completion(&b->go);
+
+	while (i < benchops && !kthread_should_stop()) {
+		if (w->role == VFIFO_PRODUCER || (w->role == VFIFO_PAIRED && !held))
+			n = vfifo_enqueue(&b->qs, msg, sizeof(msg), sizeof(msg));
+		else
+			n = vfifo_dequeue(&b->qs, msg, sizeof(msg), sizeof(msg));
+		if (n) {
+			if (w->role == VFIFO_PAIRED)
+				held = !held;
+			/** a pair counts a message once it took one back */
+			if (!held)
+				i++;
+			continue;
+		}
+		/** full or empty: let the other side run if it shares the cpu */
+		cond_resched();
+		cpu_relax();
+	}
+
+	if (atomic_dec_and_test(&b->left))
+		complete(&b->done);
+	vfifo_wait_stop();
+	return 0;
+}
+
+/**
+ * Returns messages/s over nr threads or a negative error
+ */
+static long long vfifo_bench_run(struct vfifo_bench *b, struct vfifo_worker *w,
+				int nr, bool is_shared, bool paired,
+				unsigned long *steals)
+{
+	int i, cpu, ret;
+	u64 t0, elapsed;
+
+	ret = vfifo_qset_alloc(&b->qs, is_shared);
+	if (ret)
+		return ret;
+	reinit_completion(&b->go);
+	reinit_completion(&b->done);
+	atomic_set(&b->left, nr);
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < nr; i++) {
+		w[i].b = b;
+		if (paired)
+			w[i].role = VFIFO_PAIRED;
+		else
+			w[i].role = i & 1 ? VFIFO_CONSUMER : VFIFO_PRODUCER;
+		w[i].task = kthread_create(vfifo_worker_fn, &w[i], "vfifobench/%d", i);
+		if (IS_ERR(w[i].task)) {
+			ret = PTR_ERR(w[i].task);
+			nr = i;
+			goto stop;
+		}
+		kthread_bind(w[i].task, cpu);
+		wake_up_process(w[i].task);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	t0 = ktime_get_ns();
+	complete_all(&b->go);
+	ret = wait_for_completion_interruptible(&b->done);
+	elapsed = ktime_get_ns() - t0;
+
+stop:
+	/** a failed or interrupted run still has to release the threads */
+	complete_all(&b->go);
+	for (i = 0; i < nr; i++)
+		kthread_stop(w[i].task);
+
+	*steals = 0;
+	for_each_possible_cpu(cpu)
+		*steals += b->qs.q[cpu].steals;
+	vfifo_qset_free(&b->qs);
+	if (ret)
+		return ret;
+
+	/** every message is counted once, when it is consumed */
+	return div64_u64((u64)(paired ? nr : nr / 2) * benchops * NSEC_PER_SEC,
+			elapsed ? elapsed : 1);
+}
+
+static int vfifo_bench_show(struct seq_file *m, void *v)
+{
+	struct vfifo_bench *b;
+	struct vfifo_worker *w;
+	int n = num_online_cpus() & ~1;
+	unsigned long steals;
+	long long rate = 0;
+	int mode, paired, nr;
+
+	if (!benchops || qsize < VFIFO_MSG_SIZE)
+		return -EINVAL;
+	if (n < 2) {
+		seq_puts(m, "needs two online cpus\n");
+		return 0;
+	}
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	w = kcalloc(n, sizeof(*w), GFP_KERNEL);
+	if (!b || !w) {
+		rate = -ENOMEM;
+		goto out;
+	}
+	init_completion(&b->go);
+	init_completion(&b->done);
+
+	seq_printf(m, "%u messages of %d bytes per producer or pair, %u byte queues\n",
+			benchops, VFIFO_MSG_SIZE, qsize);
+	seq_puts(m, "  queues placement threads      msgs/s     steals\n");
+	for (mode = 1; mode >= 0; mode--) {
+		for (paired = 0; paired <= 1; paired++) {
+			for (nr = 2; ; nr = min(nr * 2, n)) {
+				rate = vfifo_bench_run(b, w, nr, mode, paired, &steals);
+				if (rate < 0)
+					goto out;
+				seq_printf(m, "%8s %9s %7d %11lld %10lu\n",
+						mode ? "shared" : "percpu",
+						paired ? "paired" : "split", nr, rate, steals);
+				if (nr == n)
+					break;
+			}
+		}
+	}
+
+out:
+	kfree(w);
+	kfree(b);
+	return rate < 0 ? rate : 0;
+}
+
+static int vfifo_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vfifo_bench_show, NULL);
+}
+
+static const struct file_operations vfifo_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = vfifo_bench_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+static int vfifo_probe(struct device *dev)
+{
+	struct vfifo_dev *vdev;
+	struct device *device;
+	int minor, ret;
+
+	vdev = kzalloc(sizeof(*vdev), GFP_KERNEL);
+	if (!vdev)
+		return -ENOMEM;
+	kref_init(&vdev->ref);
+	init_waitqueue_head(&vdev->rd_wq);
+	init_waitqueue_head(&vdev->wr_wq);
+	ret = vfifo_qset_alloc(&vdev->qs, shared);
+	if (ret)
+		goto err_put;
+
+	mutex_lock(&vfifo_drv.lock);
+	minor = idr_alloc(&vfifo_drv.minors, vdev, 0, NR_MINOR_DEVCS, GFP_KERNEL);
+	mutex_unlock(&vfifo_drv.lock);
+	if (minor < 0) {
+		ret = minor;
+		goto err_put;
+	}
+	vdev->devnr = MKDEV(MAJOR(vfifo_drv.b_devnr), minor);
+	dev_set_drvdata(dev, vdev);
+
+	vdev->new_cdevice = cdev_alloc();
+	if (!vdev->new_cdevice) {
+		ret = -ENOMEM;
+		goto err_free_minor;
+	}
+	vdev->new_cdevice->ops = &vfifo_fops;
+	vdev->new_cdevice->owner = THIS_MODULE;
+	ret = cdev_add(vdev->new_cdevice, vdev->devnr, 1);
+	if (ret) {
+		dev_err(dev, "Could not register char dev: %d\n", ret);
+		goto err_unregister_cdev;
+	}
+	device = device_create(vfifo_drv.new_class, dev, vdev->devnr, NULL,
+				"%s", dev_name(dev));
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		dev_err(dev, "Could not create device: %d\n", ret);
+		goto err_unregister_cdev;
+	}
+	dev_info(dev, "%s queues of %u bytes\n", shared ? "shared" : "per cpu",
+			qsize);
+	return 0;
+
+err_unregister_cdev:
+	/** drops the cdev_alloc() reference as well */
+	cdev_del(vdev->new_cdevice);
+err_free_minor:
+	mutex_lock(&vfifo_drv.lock);
+	idr_remove(&vfifo_drv.minors, minor);
+	mutex_unlock(&vfifo_drv.lock);
+err_put:
+	kref_put(&vdev->ref, vfifo_dev_free);
+	return ret;
+}
+
+static int vfifo_remove(struct device *dev)
+{
+	struct vfifo_dev *vdev = dev_get_drvdata(dev);
+
+	device_destroy(vfifo_drv.new_class, vdev->devnr);
+	/** no new opens find it after this */
+	mutex_lock(&vfifo_drv.lock);
+	idr_remove(&vfifo_drv.minors, MINOR(vdev->devnr));
+	mutex_unlock(&vfifo_drv.lock);
+	cdev_del(vdev->new_cdevice);
+
+	WRITE_ONCE(vdev->gone, true);
+	wake_up_interruptible(&vdev->rd_wq);
+	wake_up_interruptible(&vdev->wr_wq);
+	/** the queues go with the last open file */
+	kref_put(&vdev->ref, vfifo_dev_free);
+	return 0;
+}
+
+static const struct virtbus_device_id vfifo_ids[] = {
+	{ .compatible = "virtbus-fifo-dev" },
+	{ }
+};
+
+static struct virtbus_drvr vfifo_drvr = {
+	.driver = {
+		.name = "virtbus-fifo",
+		.owner = THIS_MODULE,
+		.probe = vfifo_probe,
+		.remove = vfifo_remove
+	},
+	.id_table = vfifo_ids
+};
+
+static int __init vfifo_init(void)
+{
+	int ret;
+
+	idr_init(&vfifo_drv.minors);
+	mutex_init(&vfifo_drv.lock);
+	ret = alloc_chrdev_region(&vfifo_drv.b_devnr, BASE_MINORS, NR_MINOR_DEVCS,
+				DEVICE_NAME);
+	if (ret < 0) {
+		pr_err("failed to allocate device numbers: %d\n", ret);
+		return ret;
+	}
+	vfifo_drv.new_class = class_create(THIS_MODULE, DEVICE_CLASS);
+	if (IS_ERR(vfifo_drv.new_class)) {
+		ret = PTR_ERR(vfifo_drv.new_class);
+		pr_err("failed to create class: %d\n", ret);
+		goto err_unregister_chrdev;
+	}
+
+	vfifo_drv.dbg_dir = debugfs_create_dir("virtbus_fifo", NULL);
+	debugfs_create_file("bench", S_IRUSR, vfifo_drv.dbg_dir, NULL,
+			&vfifo_bench_fops);
+
+	ret = register_virtbus_driver(&vfifo_drvr);
+	if (ret) {
+		pr_err("failed to register driver: %d\n", ret);
+		goto err_destroy_class;
+	}
+	return 0;
+
+err_destroy_class:
+	debugfs_remove_recursive(vfifo_drv.dbg_dir);
+	class_destroy(vfifo_drv.new_class);
+err_unregister_chrdev:
+	unregister_chrdev_region(vfifo_drv.b_devnr, NR_MINOR_DEVCS);
+	return ret;
+}
+
+static void __exit vfifo_exit(void)
+{
+	unregister_virtbus_driver(&vfifo_drvr);
+	debugfs_remove_recursive(vfifo_drv.dbg_dir);
+	class_destroy(vfifo_drv.new_class);
+	unregister_chrdev_region(vfifo_drv.b_devnr, NR_MINOR_DEVCS);
+	idr_destroy(&vfifo_drv.minors);
+}
+
+module_init(vfifo_init);
+module_exit(vfifo_exit);
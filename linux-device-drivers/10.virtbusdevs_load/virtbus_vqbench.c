@@ -0,0 +1,256 @@
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "virtbus.h"
+
+MODULE_AUTHOR("Arabic Linux Community");
+MODULE_DESCRIPTION("virtbus virtqueue benchmark");
+MODULE_LICENSE("GPL");
+
+/**
+ * Buffers sent per run and their size. A run keeps `depth' buffers in
+ * flight, re-adding each one as it comes back; depth 1 is ping-pong.
+ */
+static unsigned int vqops = 100000;
+module_param(vqops, uint, 0);
+static unsigned int vqbufsize = 4096;
+module_param(vqbufsize, uint, 0);
+
+struct vqbench {
+	struct virtbus_vq *vq;
+	struct dentry *dbg_file;
+	struct mutex run_lock;	/** one run per device at a time */
+	spinlock_t lock;	/** driver side of the vq and the counts */
+	struct completion done;
+	unsigned long target;
+	unsigned long sent;
+	unsigned long completed;
+	unsigned long touched;
+};
+
+static struct dentry *vqbench_dir;
+
+/**
+ * Runs from the device's notify, drains the used ring and refills
+ * until target buffers were sent. Callbacks stay off while draining,
+ * which lets the device batch its notifications.
+ */
+static void vqbench_notify(struct virtbus_vq *vq)
+{
+	struct vqbench *b = vq->drv_priv;
+	bool refill = false;
+	u8 *buf;
+
+	spin_lock(&b->lock);
+	do {
+		virtbus_vq_disable_cb(vq);
+		while ((buf = virtbus_vq_get_buf(vq, NULL))) {
+			b->completed++;
+			if (buf[0] == 0xff)
+				b->touched++;
+			if (b->sent < b->target) {
+				buf[0] = 0;
+				virtbus_vq_add_buf(vq, buf, vqbufsize,
+					VIRTBUS_VRING_DESC_F_WRITE, buf);
+				b->sent++;
+				refill = true;
+			}
+		}
+	} while (virtbus_vq_enable_cb(vq));
+	if (refill)
+		virtbus_vq_kick(vq);
+	if (b->completed == b->target)
+		complete(&b->done);
+	spin_unlock(&b->lock);
+}
+
+static long long vqbench_run(struct vqbench *b, void **bufs, unsigned int depth,
+			unsigned long *kicks, unsigned long *notifies)
+{
+	struct virtbus_vq *vq = b->vq;
+	unsigned long kicks0, notifies0;
+	unsigned int i;
+	u64 t0;
+	int ret;
+
+	reinit_completion(&b->done);
+	spin_lock(&b->lock);
+	b->target = vqops;
+	b->sent = 0;
+	b->completed = 0;
+	b->touched = 0;
+	kicks0 = vq->kicks;
+	notifies0 = READ_ONCE(vq->notifies);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < depth && b->sent < b->target; i++) {
+		((u8 *)bufs[i])[0] = 0;
+		virtbus_vq_add_buf(vq, bufs[i], vqbufsize,
+			VIRTBUS_VRING_DESC_F_WRITE, bufs[i]);
+		b->sent++;
+	}
+	virtbus_vq_kick(vq);
+	spin_unlock(&b->lock);
+
+	ret = wait_for_completion_interruptible(&b->done);
+	if (ret) {
+		/** stop refilling, then let the in-flight ones come back */
+		spin_lock(&b->lock);
+		b->target = b->sent;
+		if (b->completed == b->target)
+			complete(&b->done);
+		spin_unlock(&b->lock);
+		wait_for_completion(&b->done);
+		return ret;
+	}
+	t0 = ktime_get_ns() - t0;
+
+	*kicks = vq->kicks - kicks0;
+	*notifies = READ_ONCE(vq->notifies) - notifies0;
+	return t0;
+}
+
+static int vqbench_show(struct seq_file *m, void *v)
+{
+	struct vqbench *b = m->private;
+	unsigned int depths[] = { 1, 8, 64, b->vq->num };
+	unsigned long kicks, notifies;
+	unsigned int i, d, last = 0;
+	long long ns = 0;
+	void **bufs;
+
+	if (!vqops || !vqbufsize)
+		return -EINVAL;
+
+	bufs = kcalloc(b->vq->num, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+	for (i = 0; i < b->vq->num; i++) {
+		bufs[i] = kmalloc(vqbufsize, GFP_KERNEL);
+		if (!bufs[i]) {
+			ns = -ENOMEM;
+			goto out;
+		}
+	}
+
+	mutex_lock(&b->run_lock);
+	seq_printf(m, "%u buffers of %u bytes per run, ring of %u\n",
+			vqops, vqbufsize, b->vq->num);
+	seq_puts(m, "depth    ns/op     ops/s     MB/s  kicks/1k  notifies/1k  touched\n");
+	for (d = 0; d < ARRAY_SIZE(depths); d++) {
+		/** depths[] is ascending, skip num when it repeats one */
+		if (depths[d] > b->vq->num || depths[d] <= last)
+			continue;
+		last = depths[d];
+		ns = vqbench_run(b, bufs, depths[d], &kicks, &notifies);
+		if (ns < 0)
+			break;
+		seq_printf(m, "%5u %8llu %9llu %8llu %9lu %12lu %8lu\n",
+			depths[d], div_u64(ns, vqops),
+			div64_u64((u64)vqops * NSEC_PER_SEC, ns ? ns : 1),
+			div64_u64((u64)vqops * vqbufsize * 1000, ns ? ns : 1),
+			kicks * 1000 / vqops, notifies * 1000 / vqops,
+			b->touched);
+	}
+	mutex_unlock(&b->run_lock);
+
+out:
+	for (i = 0; i < b->vq->num; i++)
+		kfree(bufs[i]);
+	kfree(bufs);
+	return ns < 0 ? ns : 0;
+}
+
+static int vqbench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vqbench_show, inode->i_private);
+}
+
+static const struct file_operations vqbench_fops = {
+	.owner = THIS_MODULE,
+	.open = vqbench_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+static int vqbench_probe(struct device *dev)
+{
+	struct virtbus_dev *virtbusdev = to_virtbus_dev(dev);
+	struct vqbench *b;
+
+	if (!virtbusdev->nr_vqs)
+		return -ENODEV;
+
+	b = devm_kzalloc(dev, sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	b->vq = virtbusdev->vqs[0];
+	mutex_init(&b->run_lock);
+	spin_lock_init(&b->lock);
+	init_completion(&b->done);
+
+	b->vq->drv_priv = b;
+	WRITE_ONCE(b->vq->notify, vqbench_notify);
+	dev_set_drvdata(dev, b);
+
+	b->dbg_file = debugfs_create_file(dev_name(dev), S_IRUSR, vqbench_dir,
+			b, &vqbench_fops);
+	dev_info(dev, "vqbench bound, ring of %u\n", b->vq->num);
+	return 0;
+}
+
+static int vqbench_remove(struct device *dev)
+{
+	struct vqbench *b = dev_get_drvdata(dev);
+
+	/** waits for a running benchmark, nothing is in flight after */
+	debugfs_remove(b->dbg_file);
+	WRITE_ONCE(b->vq->notify, NULL);
+	/** a device work may have loaded notify before, devm frees b next */
+	virtbus_vq_sync(b->vq);
+	return 0;
+}
+
+static const struct virtbus_device_id vqbench_ids[] = {
+	{ .compatible = "virtbus-vq-dev" },
+	{ }
+};
+
+static struct virtbus_drvr vqbench_drvr = {
+	.driver = {
+		.name = "virtbus-vqbench",
+		.owner = THIS_MODULE,
+		.probe = vqbench_probe,
+		.remove = vqbench_remove
+	},
+	.id_table = vqbench_ids
+};
+
+static int __init vqbench_init(void)
+{
+	int ret;
+
+	vqbench_dir = debugfs_create_dir("virtbus_vqbench", NULL);
+	ret = register_virtbus_driver(&vqbench_drvr);
+	if (ret) {
+		pr_err("failed to register vqbench driver: %d\n", ret);
+		debugfs_remove_recursive(vqbench_dir);
+	}
+	return ret;
+}
+
+static void __exit vqbench_exit(void)
+{
+	unregister_virtbus_driver(&vqbench_drvr);
+	debugfs_remove_recursive(vqbench_dir);
+}
+
+module_init(vqbench_init);
+module_exit(vqbench_exit);
@@ -1,11 +1,31 @@
 #include <linux/module.h>
 #include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
 #include "virtbus.h"
 
 MODULE_AUTHOR("Arabic Linux Community");
 MODULE_DESCRIPTION("virtbusdevs Load");
 MODULE_LICENSE("GPL");
 
+/**
+ * virtbus-vq-dev devices with one split-ring virtqueue of vq_num
+ * entries each, served by the echo device below.
+ */
+static unsigned int nr_vqdevs = 1;
+module_param(nr_vqdevs, uint, 0);
+static unsigned int vq_num = 256;
+module_param(vq_num, uint, 0);
+
+struct virtbus_vqdev {
+	struct virtbus_dev virtbusdev;
+	struct virtbus_vq *vq;
+	struct work_struct work;
+};
+
+static struct virtbus_vqdev *vqdevs;
+static unsigned int nr_vqdevs_registered;
+
 void virtbus_load_release(struct device*dev)
 {
 	pr_info("virtbus_load released\n");
@@ -27,10 +47,134 @@ struct virtbus_dev virtbus_dev1 = {
 	}
 };
 
+/**
+ * The device side: drain the available ring, flip the first byte of
+ * each buffer in place so the driver can see it was touched, return
+ * it and notify once per batch. Kicks are suppressed while draining.
+ */
+static void virtbus_vqdev_work(struct work_struct *work)
+{
+	struct virtbus_vqdev *vqdev = container_of(work, struct virtbus_vqdev, work);
+	struct virtbus_vq *vq = vqdev->vq;
+	struct virtbus_vring_desc *desc;
+	unsigned int done;
+	u8 *buf;
+	u16 head;
+
+	do {
+		virtbus_vq_disable_kick(vq);
+		done = 0;
+		while ((desc = virtbus_vq_pop(vq, &head))) {
+			buf = (u8 *)(uintptr_t)desc->addr;
+			if (desc->len)
+				buf[0] ^= 0xff;
+			virtbus_vq_push(vq, head,
+				desc->flags & VIRTBUS_VRING_DESC_F_WRITE ? desc->len : 0);
+			done++;
+		}
+		if (done)
+			virtbus_vq_notify(vq);
+	} while (virtbus_vq_enable_kick(vq));
+}
+
+static void virtbus_vqdev_kick(struct virtbus_vq *vq)
+{
+	struct virtbus_vqdev *vqdev = vq->dev_priv;
+
+	queue_work(system_highpri_wq, &vqdev->work);
+}
+
+static void virtbus_vqdev_sync(struct virtbus_vq *vq)
+{
+	struct virtbus_vqdev *vqdev = vq->dev_priv;
+
+	flush_work(&vqdev->work);
+}
+
+static void virtbus_vqdevs_del(void)
+{
+	struct virtbus_vqdev *vqdev;
+
+	while (nr_vqdevs_registered) {
+		vqdev = &vqdevs[--nr_vqdevs_registered];
+		unregister_virtbus_device(&vqdev->virtbusdev);
+		cancel_work_sync(&vqdev->work);
+		virtbus_vq_destroy(vqdev->vq);
+	}
+	kfree(vqdevs);
+	vqdevs = NULL;
+}
+
+/**
+ * The vqs are set up first, the devices are then added in one batch
+ * so their probes run in parallel.
+ */
+static int virtbus_vqdevs_add(void)
+{
+	struct virtbus_vqdev *vqdev;
+	struct virtbus_dev **devs;
+	unsigned int i;
+	int ret;
+
+	vqdevs = kcalloc(nr_vqdevs, sizeof(*vqdevs), GFP_KERNEL);
+	devs = kcalloc(nr_vqdevs, sizeof(*devs), GFP_KERNEL);
+	if (!vqdevs || !devs) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	for (i = 0; i < nr_vqdevs; i++) {
+		vqdev = &vqdevs[i];
+		vqdev->vq = virtbus_vq_create(vq_num);
+		if (IS_ERR(vqdev->vq)) {
+			ret = PTR_ERR(vqdev->vq);
+			goto err_destroy;
+		}
+		vqdev->vq->kick = virtbus_vqdev_kick;
+		vqdev->vq->sync = virtbus_vqdev_sync;
+		vqdev->vq->dev_priv = vqdev;
+		INIT_WORK(&vqdev->work, virtbus_vqdev_work);
+		vqdev->virtbusdev.name = "virtbus-vq-dev";
+		vqdev->virtbusdev.id = i;
+		vqdev->virtbusdev.vqs = &vqdev->vq;
+		vqdev->virtbusdev.nr_vqs = 1;
+		devs[i] = &vqdev->virtbusdev;
+	}
+
+	ret = register_virtbus_devices(devs, nr_vqdevs);
+	if (ret)
+		goto err_destroy;
+	nr_vqdevs_registered = nr_vqdevs;
+	kfree(devs);
+	return 0;
+
+err_destroy:
+	while (i--) {
+		cancel_work_sync(&vqdevs[i].work);
+		virtbus_vq_destroy(vqdevs[i].vq);
+	}
+err_free:
+	pr_err("virtbus-vq-dev registration failed: %d\n", ret);
+	kfree(devs);
+	kfree(vqdevs);
+	vqdevs = NULL;
+	return ret;
+}
+
 static int __init virtbusdevs_load_init(void)
 {
+	int ret;
+
 	register_virtbus_device(&virtbus_dev0);
 	register_virtbus_device(&virtbus_dev1);
+	if (nr_vqdevs) {
+		ret = virtbus_vqdevs_add();
+		if (ret) {
+			unregister_virtbus_device(&virtbus_dev0);
+			unregister_virtbus_device(&virtbus_dev1);
+			return ret;
+		}
+	}
 	pr_info("virtbusdevs_load initialized\n");
 
 	return 0;
@@ -40,6 +184,8 @@ static void __exit virtbusdevs_load_exit(void)
 {
 	unregister_virtbus_device(&virtbus_dev0);
 	unregister_virtbus_device(&virtbus_dev1);
+	if (vqdevs)
+		virtbus_vqdevs_del();
 	pr_info("virtbusdevs_load exit\n");
 }
 
@@ -1,4 +1,14 @@
+#include <linux/ioctl.h>
+
 struct pltdata_fifo {
 	int version;
 	int fsize;
-};
\ No newline at end of file
+};
+
+/**
+ * Reserved-memory fifos only: drop up to arg queued bytes that were
+ * read through the mmap()ed buffer, returns the number dropped.
+ */
+#define PLTDRV_IOC_MAGIC	'p'
+#define PLTDRV_IOC_MAX_NR	(1)
+#define PLTDRV_IOC_CONSUME	_IO(PLTDRV_IOC_MAGIC, 1)
@@ -8,6 +8,14 @@
 #include <linux/device.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/idr.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
 #include "pltdata.h"
 
 MODULE_AUTHOR("Arabic Linux Community");
@@ -16,47 +24,228 @@ MODULE_LICENSE("GPL");
 
 #define DEFAULT_FIFO_SIZE	(16)
 #define BASE_MINORS			(0)
-#define NR_MINOR_DEVCS		(2)
+#define NR_MINOR_DEVCS		(4096)
 #define DEVICE_NAME			"pltdrv-fifo"
 #define DEVICE_CLASS		"pltdrv-fifoclass"
 
+/**
+ * Open files keep a reference, so the state outlives remove until the
+ * last close. Remove sets gone under open_lock and cancels free_work,
+ * a later release then neither re-arms it nor frees the fifo; the
+ * last reference does. Opens find the device through the minors idr.
+ */
 struct fifo_prvt_devc {
-	struct cdev new_cdevice;
+	struct kref ref;
+	bool gone;
+	struct cdev *new_cdevice;
 	struct kfifo myfifo;
 	struct mutex r_f_lock;
 	struct mutex w_f_lock;
 	struct pltdata_fifo plt_data_prv;
 	dev_t devnr;
+	/**
+	 * Set when the node has a memory-region: the kfifo buffer is the
+	 * reserved region instead of a heap allocation, and can be mapped.
+	 */
+	void *rmem_virt;
+	phys_addr_t rmem_phys;
+	size_t rmem_size;
+	/**
+	 * org,lazy-alloc: the heap fifo is allocated by the first open and
+	 * freed org,idle-grace-ms after the last release, if it is empty
+	 * by then. open_lock protects users and allocated.
+	 */
+	bool lazy;
+	bool allocated;
+	unsigned int users;
+	unsigned int grace_ms;
+	struct mutex open_lock;
+	struct delayed_work free_work;
 };
 
+/**
+ * Probes run asynchronously and in parallel, so minors come from an
+ * IDR under lock and the probe counters are only touched under
+ * stats_lock.
+ */
 struct prvt_drv {
 	dev_t b_devnr;
-	struct device *device;
 	struct class *new_class;
+	struct idr minors;	/** minor -> fifo_prvt_devc */
+	struct mutex lock;
+	spinlock_t stats_lock;
 	unsigned int nr_devcs_probed;
+	unsigned long nr_probes;
+	u64 probe_ns_sum;
+	u64 probe_ns_max;
+	u64 first_probe_start;
+	u64 last_probe_end;
 };
 struct prvt_drv prv_drv;
 
+/**
+ * Keep the platform device id as minor when it is free, so boards that
+ * number their fifos get stable names; DT nodes (id -1) and anything
+ * else take the lowest free minor.
+ */
+static int pltdrv_get_minor(int id, struct fifo_prvt_devc *dev)
+{
+	int minor = -ENOSPC;
+
+	mutex_lock(&prv_drv.lock);
+	if (id >= 0 && id < NR_MINOR_DEVCS)
+		minor = idr_alloc(&prv_drv.minors, dev, id, id + 1, GFP_KERNEL);
+	if (minor < 0)
+		minor = idr_alloc(&prv_drv.minors, dev, 0, NR_MINOR_DEVCS,
+					GFP_KERNEL);
+	mutex_unlock(&prv_drv.lock);
+	return minor;
+}
+
+static void pltdrv_put_minor(int minor)
+{
+	mutex_lock(&prv_drv.lock);
+	idr_remove(&prv_drv.minors, minor);
+	mutex_unlock(&prv_drv.lock);
+}
+
+static void pltdrv_probe_account(u64 start, u64 end)
+{
+	spin_lock(&prv_drv.stats_lock);
+	if (!prv_drv.nr_probes || start < prv_drv.first_probe_start)
+		prv_drv.first_probe_start = start;
+	if (end > prv_drv.last_probe_end)
+		prv_drv.last_probe_end = end;
+	prv_drv.nr_probes++;
+	prv_drv.probe_ns_sum += end - start;
+	if (end - start > prv_drv.probe_ns_max)
+		prv_drv.probe_ns_max = end - start;
+	prv_drv.nr_devcs_probed++;
+	spin_unlock(&prv_drv.stats_lock);
+}
+
+static void pltdrv_free_idle(struct work_struct *work)
+{
+	struct fifo_prvt_devc *dev = container_of(to_delayed_work(work),
+					struct fifo_prvt_devc, free_work);
+
+	mutex_lock(&dev->open_lock);
+	if (!dev->users && dev->allocated && kfifo_is_empty(&dev->myfifo)) {
+		kfifo_free(&dev->myfifo);
+		dev->allocated = false;
+	}
+	mutex_unlock(&dev->open_lock);
+}
+
 static int setup_pltdrv_dev(struct fifo_prvt_devc *dev)
 {
 	int ret;
 	int fsize = dev->plt_data_prv.fsize;
 	mutex_init(&dev->r_f_lock);
 	mutex_init(&dev->w_f_lock);
+	mutex_init(&dev->open_lock);
+	INIT_DELAYED_WORK(&dev->free_work, pltdrv_free_idle);
+	if (dev->lazy)
+		return 0;
+	if (dev->rmem_virt) {
+		/**
+		 * No org,fsize means the whole region; kfifo_init()
+		 * rounds down to a power of two.
+		 */
+		ret = kfifo_init(&dev->myfifo, dev->rmem_virt,
+				fsize > 0 ? min_t(size_t, fsize, dev->rmem_size) :
+				dev->rmem_size);
+		if (!ret)
+			dev->plt_data_prv.fsize = kfifo_size(&dev->myfifo);
+		return ret;
+	}
 	ret = kfifo_alloc(&dev->myfifo,
 				fsize, GFP_KERNEL);
+	if (!ret)
+		dev->allocated = true;
 	return ret;
 }
 
 static void uninstall_pltdrv_dev(struct fifo_prvt_devc *dev)
 {
-	kfifo_free(&dev->myfifo);
+	if (dev->allocated)
+		kfifo_free(&dev->myfifo);
+	if (dev->rmem_virt)
+		memunmap(dev->rmem_virt);
+}
+
+static void pltdrv_dev_free(struct kref *ref)
+{
+	struct fifo_prvt_devc *dev = container_of(ref, struct fifo_prvt_devc, ref);
+
+	uninstall_pltdrv_dev(dev);
+	kfree(dev);
+}
+
+/**
+ * Optional memory-region phandle: the fifo then lives in that
+ * physically contiguous carve-out. The region must stay in the linear
+ * map (no "no-map") for the write-back memremap, which is undone with
+ * the last reference rather than by devm, open files still use it.
+ */
+static int pltdrv_parse_rmem(struct device *dev, struct fifo_prvt_devc *dev_data)
+{
+	struct device_node *rmem_nd;
+	struct reserved_mem *rmem;
+	void *virt;
+
+	rmem_nd = of_parse_phandle(dev->of_node, "memory-region", 0);
+	if (!rmem_nd)
+		return 0;
+	rmem = of_reserved_mem_lookup(rmem_nd);
+	of_node_put(rmem_nd);
+	if (!rmem) {
+		dev_err(dev, "memory-region is not a reserved memory node\n");
+		return -EINVAL;
+	}
+
+	virt = memremap(rmem->base, rmem->size, MEMREMAP_WB);
+	if (!virt) {
+		dev_err(dev, "Could not map reserved memory %pa\n", &rmem->base);
+		return -ENOMEM;
+	}
+	dev_data->rmem_virt = virt;
+	dev_data->rmem_phys = rmem->base;
+	dev_data->rmem_size = rmem->size;
+	dev_info(dev, "fifo in reserved memory %pa, %zu bytes\n",
+			&dev_data->rmem_phys, dev_data->rmem_size);
+	return 0;
 }
 
 static int pltdrv_open_fifo(struct inode *inode, struct file *filp)
 {
 	struct fifo_prvt_devc *dev;
-	dev = container_of(inode->i_cdev, struct fifo_prvt_devc, new_cdevice);
+	int ret = 0;
+
+	mutex_lock(&prv_drv.lock);
+	dev = idr_find(&prv_drv.minors, iminor(inode));
+	if (dev)
+		kref_get(&dev->ref);
+	mutex_unlock(&prv_drv.lock);
+	if (!dev)
+		return -ENODEV;
+
+	mutex_lock(&dev->open_lock);
+	/** a pending free_work sees users and leaves the fifo alone */
+	if (dev->lazy && !dev->allocated) {
+		ret = kfifo_alloc(&dev->myfifo, dev->plt_data_prv.fsize,
+					GFP_KERNEL);
+		if (!ret)
+			dev->allocated = true;
+	}
+	if (!ret)
+		dev->users++;
+	mutex_unlock(&dev->open_lock);
+	if (ret) {
+		kref_put(&dev->ref, pltdrv_dev_free);
+		return ret;
+	}
+
 	filp->private_data = dev;
 	pr_info("Open FIFO driver\n");
 	return 0;
@@ -64,6 +253,15 @@ static int pltdrv_open_fifo(struct inode *inode, struct file *filp)
 
 static int pltdrv_release_fifo(struct inode *inode, struct file *filp)
 {
+	struct fifo_prvt_devc *dev = (struct fifo_prvt_devc *)filp->private_data;
+
+	mutex_lock(&dev->open_lock);
+	/** after remove the fifo goes with the last reference instead */
+	if (!--dev->users && dev->lazy && !dev->gone)
+		mod_delayed_work(system_wq, &dev->free_work,
+				msecs_to_jiffies(dev->grace_ms));
+	mutex_unlock(&dev->open_lock);
+	kref_put(&dev->ref, pltdrv_dev_free);
 	pr_info("Close FIFO driver\n");
 	return 0;
 }
@@ -121,12 +319,90 @@ static ssize_t pltdrv_read_fifo(struct file *file, char __user *buf,
 	return copiedout;
 }
 
+/**
+ * Read-only mapping of a reserved-memory fifo buffer. Consumers find
+ * the queued bytes at out & (size - 1) from fifoindex, read them in
+ * place and consume them with the PLTDRV_IOC_CONSUME ioctl.
+ */
+static int pltdrv_mmap_fifo(struct file *file, struct vm_area_struct *vma)
+{
+	struct fifo_prvt_devc *dev = (struct fifo_prvt_devc *)file->private_data;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long size;
+
+	if (!dev->rmem_virt)
+		return -ENODEV;
+	if (!PAGE_ALIGNED(dev->rmem_phys))
+		return -ENXIO;
+
+	size = min_t(unsigned long, PAGE_ALIGN(kfifo_size(&dev->myfifo)),
+			dev->rmem_size & PAGE_MASK);
+	if (vma->vm_pgoff > size >> PAGE_SHIFT ||
+	    len > size - (vma->vm_pgoff << PAGE_SHIFT))
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_pfn_range(vma, vma->vm_start,
+			PHYS_PFN(dev->rmem_phys) + vma->vm_pgoff,
+			len, vma->vm_page_prot);
+}
+
+/**
+ * Drop up to n queued bytes of a reserved-memory fifo without copying
+ * them out, after the consumer read them through the mapping. Returns
+ * the number of bytes dropped.
+ */
+static unsigned int pltdrv_consume_fifo(struct fifo_prvt_devc *dev,
+					unsigned int n)
+{
+	unsigned int i;
+
+	n = min(n, kfifo_len(&dev->myfifo));
+	/** the consumer's loads of the data come before freeing it */
+	smp_mb();
+	/** a byte fifo skips one byte per call, an index increment */
+	for (i = 0; i < n; i++)
+		kfifo_skip(&dev->myfifo);
+	return n;
+}
+
+static long pltdrv_ioctl_fifo(struct file *file, unsigned int cmd,
+				unsigned long arg)
+{
+	struct fifo_prvt_devc *dev = (struct fifo_prvt_devc *)file->private_data;
+	long ret;
+
+	if (_IOC_TYPE(cmd) != PLTDRV_IOC_MAGIC)
+		return -ENOTTY;
+	if (_IOC_NR(cmd) > PLTDRV_IOC_MAX_NR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case PLTDRV_IOC_CONSUME:
+		/** heap fifos are only read through read() */
+		if (!dev->rmem_virt)
+			return -ENOTTY;
+		if (mutex_lock_interruptible(&dev->r_f_lock))
+			return -ERESTARTSYS;
+		ret = pltdrv_consume_fifo(dev, (unsigned int)arg);
+		mutex_unlock(&dev->r_f_lock);
+		return ret;
+	default:
+		return -ENOTTY;
+	}
+}
+
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = pltdrv_open_fifo,
 	.release = pltdrv_release_fifo,
 	.read = pltdrv_read_fifo,
-	.write = pltdrv_write_fifo
+	.write = pltdrv_write_fifo,
+	.mmap = pltdrv_mmap_fifo,
+	.unlocked_ioctl = pltdrv_ioctl_fifo,
+	.llseek = no_llseek
 };
 
 static ssize_t show_fsize(struct device *dev, struct device_attribute *attr, 
@@ -161,12 +437,26 @@ static ssize_t store_fversion(struct device *dev, struct device_attribute *attr,
 	return count;
 }
 
+static ssize_t show_findex(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	struct fifo_prvt_devc * dev_data;
+	dev_data = (struct fifo_prvt_devc *)dev_get_drvdata(dev);
+	return sprintf(buf, "%u %u %u\n",
+		READ_ONCE(dev_data->myfifo.kfifo.in),
+		READ_ONCE(dev_data->myfifo.kfifo.out),
+		dev_data->allocated || dev_data->rmem_virt ?
+		kfifo_size(&dev_data->myfifo) : 0);
+}
+
 static DEVICE_ATTR(fifosize, S_IRUGO, show_fsize, NULL);
+static DEVICE_ATTR(fifoindex, S_IRUGO, show_findex, NULL);
 static DEVICE_ATTR(fifoversion, S_IRUGO|S_IWUSR, show_fversion, store_fversion);
 
 static struct attribute * fifo_attrs[] = {
 	&dev_attr_fifosize.attr,
 	&dev_attr_fifoversion.attr,
+	&dev_attr_fifoindex.attr,
 	NULL
 };
 
@@ -198,7 +488,9 @@ struct pltdata_fifo * parse_dt_arg_devcs(struct device *dev)
 		dev_info(dev,"Could not get version property\n");
 		return ERR_PTR(-EINVAL);
 	}
-	if(of_property_read_s32(dev_nd,"org,fsize",&plt_data->fsize) ){
+	/** a memory-region alone sizes the fifo */
+	if(of_property_read_s32(dev_nd,"org,fsize",&plt_data->fsize) &&
+	   !of_find_property(dev_nd, "memory-region", NULL)){
 		dev_info(dev,"Could not get fsize property\n");
 		return ERR_PTR(-EINVAL);
 	}
@@ -212,6 +504,9 @@ struct pltdata_fifo * parse_dt_arg_devcs(struct device *dev)
 static int pltdrv_probe(struct platform_device *ofdev)
 {
 	int ret;
+	int minor;
+	u64 start = ktime_get_ns(), end;
+	struct device *device;
 	struct fifo_prvt_devc * dev_data;
 	struct pltdata_fifo * plt_data;
 	const struct of_device_id *match;
@@ -225,7 +520,7 @@ static int pltdrv_probe(struct platform_device *ofdev)
 			dev_info(&ofdev->dev,"Could not allocate memory for plt_data\n");
 			return -ENOMEM;
 		}
-		data_id = prv_drv.nr_devcs_probed;
+		data_id = -1;
 	} else {
 		plt_data = (struct pltdata_fifo *)dev_get_platdata(&ofdev->dev);
 		data_id =  ofdev->id;
@@ -235,57 +530,89 @@ static int pltdrv_probe(struct platform_device *ofdev)
 		pr_err("No platfrom data for a device\n");
 		return -EINVAL;
 	}
-	dev_data = (struct fifo_prvt_devc *)devm_kzalloc(&ofdev->dev,
-						sizeof(struct fifo_prvt_devc), GFP_KERNEL);
+	dev_data = kzalloc(sizeof(struct fifo_prvt_devc), GFP_KERNEL);
 
 	if(!dev_data) {
-		pr_err("Couldnot allocate memory for a device: %d\n", ret);
-		return -EINVAL;
+		pr_err("Could not allocate memory for a device\n");
+		return -ENOMEM;
 	}
+	kref_init(&dev_data->ref);
 	dev_data->plt_data_prv.version = plt_data->version;
 	dev_data->plt_data_prv.fsize = plt_data->fsize;
 	pr_info("Device version: %d\n", dev_data->plt_data_prv.version);
 	pr_info("Device fsize: %d\n", dev_data->plt_data_prv.fsize);
 
-	dev_data->devnr = prv_drv.b_devnr + data_id;
+	ret = pltdrv_parse_rmem(&ofdev->dev, dev_data);
+	if (ret)
+		goto err_put;
+	/** a reserved-memory fifo costs no heap, nothing to defer */
+	if (!dev_data->rmem_virt && ofdev->dev.of_node &&
+	    of_property_read_bool(ofdev->dev.of_node, "org,lazy-alloc")) {
+		dev_data->lazy = true;
+		of_property_read_u32(ofdev->dev.of_node, "org,idle-grace-ms",
+					&dev_data->grace_ms);
+	}
+
+	minor = pltdrv_get_minor(data_id, dev_data);
+	if (minor < 0) {
+		pr_err("No free minor for a device: %d\n", minor);
+		ret = minor;
+		goto err_put;
+	}
+	dev_data->devnr = MKDEV(MAJOR(prv_drv.b_devnr), minor);
 	pr_info("Device number: %d\n", dev_data->devnr);
 	pr_info("Device NR: %d\n",  MINOR(dev_data->devnr));
 
 	dev_set_drvdata(&ofdev->dev, dev_data);
 
-	prv_drv.device = device_create(prv_drv.new_class, &ofdev->dev, dev_data->devnr,
-								NULL, "pltdrv-fifo-%d",data_id);
-	if (IS_ERR(prv_drv.device)) {
-		ret = PTR_ERR(prv_drv.device);
-		pr_err("Could not create device: %d\n", ret);
-		return ret;
-	}
-	cdev_init(&dev_data->new_cdevice, &fops);
-	dev_data->new_cdevice.owner = THIS_MODULE;
-	ret = cdev_add(&dev_data->new_cdevice,dev_data->devnr, 1);
-	if (ret) {
-		pr_err("Could not register char dev: %d\n", ret);
-		goto err_destruct_device;
-	}
+	/**
+	 * The fifo must exist before the cdev is live and udev is told
+	 * about the node, an async probe races with the first open.
+	 */
 	ret = setup_pltdrv_dev(dev_data);
 	if (ret) {
 		pr_err("Could not create FIFO\n");
-		goto err_unregister_cdev;
+		goto err_free_minor;
 	}
 	ret = sysfs_create_group(&ofdev->dev.kobj, &fifo_attr_grp);
 	if (ret) {
 		pr_err("Could not create sysfs group\n");
-		goto err_setup_pltdrv;
+		goto err_free_minor;
+	}
+	dev_data->new_cdevice = cdev_alloc();
+	if (!dev_data->new_cdevice) {
+		ret = -ENOMEM;
+		goto err_remove_group;
+	}
+	dev_data->new_cdevice->ops = &fops;
+	dev_data->new_cdevice->owner = THIS_MODULE;
+	ret = cdev_add(dev_data->new_cdevice,dev_data->devnr, 1);
+	if (ret) {
+		pr_err("Could not register char dev: %d\n", ret);
+		goto err_unregister_cdev;
+	}
+	device = device_create(prv_drv.new_class, &ofdev->dev, dev_data->devnr,
+								NULL, "pltdrv-fifo-%d", minor);
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		pr_err("Could not create device: %d\n", ret);
+		goto err_unregister_cdev;
 	}
-	pr_info("Probe ends Successfully: NR of devices %d\n",
-				++prv_drv.nr_devcs_probed);
+	end = ktime_get_ns();
+	pltdrv_probe_account(start, end);
+	dev_info(&ofdev->dev, "Probe ends Successfully in %llu ns\n",
+				end - start);
 	return 0;
-err_setup_pltdrv:
-	uninstall_pltdrv_dev(dev_data);
 err_unregister_cdev:
-	cdev_del(&dev_data->new_cdevice);
-err_destruct_device:
-	device_destroy(prv_drv.new_class, dev_data->devnr);
+	/** drops the cdev_alloc() reference as well */
+	cdev_del(dev_data->new_cdevice);
+err_remove_group:
+	sysfs_remove_group(&ofdev->dev.kobj, &fifo_attr_grp);
+err_free_minor:
+	pltdrv_put_minor(minor);
+err_put:
+	/** nothing is open yet, this frees the fifo and the mapping */
+	kref_put(&dev_data->ref, pltdrv_dev_free);
 	return ret;
 }
 
@@ -293,29 +620,70 @@ static int pltdrv_remove(struct platform_device *ofdev)
 {
 	struct fifo_prvt_devc * dev_data;
 	dev_data = dev_get_drvdata(&ofdev->dev);
-	sysfs_remove_group(&ofdev->dev.kobj, &fifo_attr_grp);
-	uninstall_pltdrv_dev(dev_data);
-	cdev_del(&dev_data->new_cdevice);
 	device_destroy(prv_drv.new_class, dev_data->devnr);
+	/** no new opens find it after this */
+	pltdrv_put_minor(MINOR(dev_data->devnr));
+	cdev_del(dev_data->new_cdevice);
+	sysfs_remove_group(&ofdev->dev.kobj, &fifo_attr_grp);
+
+	mutex_lock(&dev_data->open_lock);
+	dev_data->gone = true;
+	mutex_unlock(&dev_data->open_lock);
+	cancel_delayed_work_sync(&dev_data->free_work);
+	/** the fifo goes with the last open file */
+	kref_put(&dev_data->ref, pltdrv_dev_free);
 	pr_info("plt Device removed\n");
-	pr_info("Remove device ends Successfully: NR of devices %d\n",
-				--prv_drv.nr_devcs_probed);
+	spin_lock(&prv_drv.stats_lock);
+	prv_drv.nr_devcs_probed--;
+	spin_unlock(&prv_drv.stats_lock);
 
 	return 0;
 }
 
+/**
+ * /sys/bus/platform/drivers/plt-fifo-dev/probe_stats: probes done,
+ * their summed and longest duration, and the wall time from the first
+ * probe start to the last probe end. A span well below the sum means
+ * the probes overlapped.
+ */
+static ssize_t probe_stats_show(struct device_driver *drv, char *buf)
+{
+	ssize_t len;
+
+	spin_lock(&prv_drv.stats_lock);
+	len = sprintf(buf, "devices %u probes %lu sum_ns %llu max_ns %llu span_ns %llu\n",
+		prv_drv.nr_devcs_probed, prv_drv.nr_probes,
+		prv_drv.probe_ns_sum, prv_drv.probe_ns_max,
+		prv_drv.nr_probes ?
+		prv_drv.last_probe_end - prv_drv.first_probe_start : 0);
+	spin_unlock(&prv_drv.stats_lock);
+	return len;
+}
+static DRIVER_ATTR_RO(probe_stats);
+
+static struct attribute *pltdrv_attrs[] = {
+	&driver_attr_probe_stats.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(pltdrv);
+
 struct platform_driver pltdrv = {
 	.probe = pltdrv_probe,
 	.remove = pltdrv_remove,
 	.driver = {
 		.name = "plt-fifo-dev",
-		.of_match_table = of_match_ptr(pltdrv_dt_matchtbl_devcs)
+		.of_match_table = of_match_ptr(pltdrv_dt_matchtbl_devcs),
+		.groups = pltdrv_groups,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS
 	}
 };
 
 static int __init pltdrv_init(void)
 {
 	int ret;
+	idr_init(&prv_drv.minors);
+	mutex_init(&prv_drv.lock);
+	spin_lock_init(&prv_drv.stats_lock);
 	ret = alloc_chrdev_region(&prv_drv.b_devnr, BASE_MINORS, NR_MINOR_DEVCS, DEVICE_NAME);
 	if (ret < 0) {
 		pr_err("failed to allocate device numbers: %d\n", ret);
@@ -329,9 +697,15 @@ static int __init pltdrv_init(void)
 	}
 	pr_info("pltdrv_attr_dt Init\n");
 	
-	platform_driver_register(&pltdrv);
+	ret = platform_driver_register(&pltdrv);
+	if (ret) {
+		pr_err("failed to register driver: %d\n", ret);
+		goto err_destroy_class;
+	}
 
 	return 0;
+err_destroy_class:
+	class_destroy(prv_drv.new_class);
 err_unregister_chrdev:
 	unregister_chrdev_region(prv_drv.b_devnr, NR_MINOR_DEVCS);
 
@@ -343,6 +717,7 @@ static void __exit pltdrv_exit(void)
 	platform_driver_unregister(&pltdrv);
 	class_destroy(prv_drv.new_class);
 	unregister_chrdev_region(prv_drv.b_devnr, NR_MINOR_DEVCS);
+	idr_destroy(&prv_drv.minors);
 	pr_info("pltdrv_attr_dt exit\n");
 }
 